@@ -14,9 +14,9 @@ struct Range {
 	vlong len;
 };
 
-static vlong	blkalloc_lk(Arena*, int);
-static vlong	blkalloc(int);
-static int	blkdealloc_lk(vlong);
+static vlong	blkalloc_lk(Arena*, vlong, int);
+static vlong	blkalloc(int, int);
+static int	blkdealloc_lk(Arena*, vlong, vlong);
 static Blk*	initblk(Blk*, vlong, int);
 static int	logop(Arena *, vlong, vlong, int);
 
@@ -52,34 +52,168 @@ clrflag(Blk *b, int f)
 	}
 }
 
+/*
+ * The bytes that go to disk for a block,
+ * and how many of them there are.
+ */
+static char*
+diskbuf(Blk *b, int *n)
+{
+	if(b->type == Traw && b->clen != 0){
+		*n = rawsz(b->bp.addr);
+		return b->zbuf;
+	}
+	if(b->type == Traw){
+		*n = rawsz(b->bp.addr);
+		return b->data;
+	}
+	if(b->clen != 0){
+		*n = rawsz(b->bp.addr);
+		return b->buf;
+	}
+	*n = Blksz;
+	return b->buf;
+}
+
 int
 syncblk(Blk *b)
 {
+	char *p;
+	int n, r;
+
 	assert(checkflag(b, Bfinal));
+	/* clean isn't on disk until the write returns */
+	setflag(b, Bwriting);
 	clrflag(b, Bdirty);
-	return pwrite(fs->fd, b->buf, Blksz, b->bp.addr);
+	p = diskbuf(b, &n);
+	r = pwrite(fs->fd, p, n, b->bp.addr);
+	clrflag(b, Bwriting);
+	return r;
+}
+
+/*
+ * Data blocks take up a whole unit of their
+ * arena: fs->blksz, or less for file tails.
+ */
+int
+rawsz(vlong bp)
+{
+	return getarena(bp)->unit;
+}
+
+/*
+ * File data blocks are fs->blksz bytes,
+ * which may be bigger than the Blksz bytes
+ * of metadata kept in b->buf.
+ */
+static char*
+rawbuf(Blk *b)
+{
+	if(fs->blksz == Blksz)
+		return b->buf;
+	if(b->raw == nil && (b->raw = malloc(fs->blksz)) == nil)
+		sysfatal("alloc raw: %r");
+	return b->raw;
+}
+
+/*
+ * Compressed file data is kept next to the
+ * inflated copy in b->data, for syncing.
+ */
+static char*
+zbuf(Blk *b)
+{
+	if(b->zbuf == nil && (b->zbuf = malloc(fs->blksz)) == nil)
+		sysfatal("alloc zbuf: %r");
+	return b->zbuf;
+}
+
+/*
+ * Marks a data block as stored compressed,
+ * as the n bytes at z.
+ */
+void
+setlz(Blk *b, char *z, int n)
+{
+	char *p;
+	int u;
+
+	assert(b->type == Traw);
+	u = rawsz(b->bp.addr);
+	assert(n > 0 && n <= u);
+	p = zbuf(b);
+	memcpy(p, z, n);
+	memset(p+n, 0, u-n);
+	b->clen = n;
+}
+
+/*
+ * Tree nodes are unpacked into a buffer that
+ * stays with the cache slot, so that we only
+ * pay for the allocation once.
+ */
+static char*
+nodebuf(Blk *b)
+{
+	if(b->node == nil && (b->node = malloc(Nodesz + Nodeix*sizeof(u32int) + Bloomsz)) == nil)
+		sysfatal("alloc node: %r");
+	b->ixnval = -1;
+	b->ixnbuf = -1;
+	return b->node;
+}
+
+static int
+preadn(char *p, vlong n, vlong off)
+{
+	vlong r;
+
+	while(n != 0){
+		r = pread(fs->fd, p, n, off);
+		if(r <= 0)
+			return -1;
+		p += r;
+		off += r;
+		n -= r;
+	}
+	return 0;
 }
 
 static Blk*
-readblk(vlong bp, int flg)
+readblk(vlong bp, int flg, int clen)
 {
 	Blk *b;
-	vlong off, rem, n;
+	vlong n;
+	char *p;
+	int meta;
 
 	assert(bp != -1);
 	if((b = cachepluck()) == nil)
 		return nil;
 	b->alloced = getcallerpc(&bp);
-	off = bp;
-	rem = Blksz;
-	while(rem != 0){
-		n = pread(fs->fd, b->buf, rem, off);
-		if(n <= 0){
-			dropblk(b);
-			return nil;
-		}
-		off += n;
-		rem -= n;
+	meta = 0;
+	if(clen != 0){
+		/* inflated by getblk once the hash checks out */
+		p = zbuf(b);
+		n = rawsz(bp);
+	}else if(flg&GBraw){
+		p = rawbuf(b);
+		n = rawsz(bp);
+		/* past the end of a tail reads as zeros */
+		memset(p+n, 0, fs->blksz-n);
+	}else{
+		/* in a fragment, it's either a compressed node or a log */
+		p = b->buf;
+		n = (rawsz(bp) < Blksz) ? rawsz(bp) : Blksz;
+		meta = 1;
+	}
+	if(preadn(p, n, bp) == -1){
+		dropblk(b);
+		return nil;
+	}
+	if(meta && n < Blksz && UNPACK16(b->buf) != Tlz
+	&& preadn(b->buf+n, Blksz-n, bp+n) == -1){
+		dropblk(b);
+		return nil;
 	}
 	b->cnext = nil;
 	b->cprev = nil;
@@ -96,8 +230,11 @@ readblk(vlong bp, int flg)
 	b->valsz = 0;
 	b->nbuf = 0;
 	b->bufsz = 0;
+	b->pvalsz = 0;
+	b->pbufsz = 0;
 	b->logsz = 0;
 	b->lognxt = 0;
+	b->clen = clen;
 
 	switch(b->type){
 	default:
@@ -105,6 +242,8 @@ readblk(vlong bp, int flg)
 		abort();
 		break;
 	case Traw:
+		b->data = (flg&GBraw) ? rawbuf(b) : b->buf;
+		break;
 	case Tarena:
 		b->data = b->buf;
 		break;
@@ -113,17 +252,13 @@ readblk(vlong bp, int flg)
 		b->data = b->buf + Loghdsz;
 		break;
 		break;
+	case Tlz:
+		b->clen = UNPACK16(b->buf+2);
+		/* fall through */
 	case Tpivot:
-		b->data = b->buf + Pivhdsz;
-		b->nval = UNPACK16(b->buf+2);
-		b->valsz = UNPACK16(b->buf+4);
-		b->nbuf = UNPACK16(b->buf+6);
-		b->bufsz = UNPACK16(b->buf+8);
-		break;
 	case Tleaf:
-		b->data = b->buf + Leafhdsz;
-		b->nval = UNPACK16(b->buf+2);
-		b->valsz = UNPACK16(b->buf+4);
+		/* unpacked by getblk once the hash checks out */
+		b->data = nodebuf(b);
 		break;
 	}
 	assert(b->magic == Magic);
@@ -158,7 +293,7 @@ freerange(Avltree *t, vlong off, vlong len)
 {
 	Arange *r, *s;
 
-	assert(len % Blksz == 0);
+	assert(len % Fragsz == 0);
 	if((r = calloc(1, sizeof(Arange))) == nil)
 		return -1;
 	r->off = off;
@@ -202,7 +337,7 @@ grabrange(Avltree *t, vlong off, vlong len)
 	Arange *r, *s, q;
 	vlong l;
 
-	assert(len % Blksz == 0);
+	assert(len % Fragsz == 0);
 	q.off = off;
 	q.len = len;
 	r = (Arange*)avllookup(t, &q.Avl, -1);
@@ -232,6 +367,19 @@ grabrange(Avltree *t, vlong off, vlong len)
 	return 0;
 }
 
+/*
+ * Move to the next block when we have
+ * 40 bytes in the log: We're appending
+ * up to 16 bytes as part of the operation,
+ * followed by 16 bytes of new log entry
+ * allocation and chaining.
+ */
+static int
+logfull(Blk *lb)
+{
+	return lb == nil || lb->logsz >= Logspc - 40;
+}
+
 /*
  * Logs an allocation. Must be called
  * with arena lock held. Duplicates some
@@ -245,31 +393,31 @@ logappend(Arena *a, vlong off, vlong len, int op, Blk **tl)
 	vlong o, ao;
 	char *p;
 
-	assert(off % Blksz == 0);
-	assert(op == LogAlloc || op == LogFree);
+	assert(off % Fragsz == 0);
+	assert(op == LogAlloc || op == LogFree || op == LogUnit);
 	o = -1;
 	lb = *tl;
 	dprint("logop %llx+%llx@%llx: %s\n", off, len, lb->logsz, (op == LogAlloc) ? "Alloc" : "Free");
-	/*
-	 * move to the next block when we have
-	 * 40 bytes in the log:
-	 * We're appending up to 16 bytes as
-	 * part of the operation, followed by
-	 * 16 bytes of new log entry allocation
-	 * and chaining.
-	 */
-	if(lb == nil || lb->logsz >= Logspc - 40){
+	if(logfull(lb)){
 		pb = lb;
-		if((o = blkalloc_lk(a, 1)) == -1)
+		/* Blksz whatever the unit, so the unit can change */
+		if((o = blkalloc_lk(a, Blksz, 1)) == -1)
 			return -1;
+		a->nlog++;
 		if((lb = cachepluck()) == nil)
 			return -1;
 		initblk(lb, o, Tlog);
 
 		lb->logsz = Loghashsz;
 		p = lb->data + lb->logsz;
-		PACK64(p+0, o|LogAlloc1);
-		PACK64(p+8, (uvlong)LogEnd);
+		if(a->unit == Blksz){
+			PACK64(p+0, o|LogAlloc1);
+			PACK64(p+8, (uvlong)LogEnd);
+		}else{
+			PACK64(p+0, o|LogAlloc);
+			PACK64(p+8, Blksz);
+			PACK64(p+16, (uvlong)LogEnd);
+		}
 		finalize(lb);
 
 		if(syncblk(lb) == -1){
@@ -290,7 +438,7 @@ logappend(Arena *a, vlong off, vlong len, int op, Blk **tl)
 		*tl = lb;
 	}
 
-	if(len == Blksz){
+	if(op != LogUnit && len == a->unit){
 		if(op == LogAlloc)
 			op = LogAlloc1;
 		else if(op == LogFree)
@@ -312,11 +460,17 @@ logappend(Arena *a, vlong off, vlong len, int op, Blk **tl)
 	 * current allocation. so that we don't
 	 * reorder allocs and frees.
 	 */
-	if(o != -1){
+	if(o != -1 && a->unit == Blksz){
 		p = lb->data + lb->logsz;
 		ao = o|LogAlloc1;
 		PACK64(p, ao);
 		lb->logsz += 8;
+	}else if(o != -1){
+		p = lb->data + lb->logsz;
+		ao = o|LogAlloc;
+		PACK64(p, ao);
+		PACK64(p+8, Blksz);
+		lb->logsz += 16;
 	}
 	/* this gets overwritten by the next append */
 	p = lb->data + lb->logsz;
@@ -328,6 +482,23 @@ logappend(Arena *a, vlong off, vlong len, int op, Blk **tl)
 static int
 logop(Arena *a, vlong off, vlong len, int op)
 {
+	/*
+	 * Filling the tail chains it to a new
+	 * block, rewriting it in place, and a
+	 * sync in flight may still write out
+	 * its older copy over ours. Wait that
+	 * out without spinning other procs on
+	 * the arena lock. Only the mutator
+	 * appends and syncs, so nothing moves
+	 * the tail while we sleep, but check
+	 * again anyway.
+	 */
+	while(a->tail != nil && logfull(a->tail)
+	&& a->tail->bp.addr == a->cmttail && fs->syncing != 0){
+		unlock(a);
+		syncwait();
+		lock(a);
+	}
 	if(logappend(a, off, len, op, &a->tail) == -1)
 		return -1;
 	if(a->head.addr == -1)
@@ -347,12 +518,14 @@ loadlog(Arena *a)
 
 
 	bp = a->head;
+	a->nlog = 0;
 Nextblk:
 	if((b = getblk(bp, GBnochk)) == nil)
 		return -1;
+	a->nlog++;
 	bh = UNPACK64(b->data);
 	/* the hash covers the log and offset */
-	if(bh != siphash(b->data+Loghashsz, Logspc-Loghashsz)){
+	if(bh != bufhash(b->data+Loghashsz, Logspc-Loghashsz)){
 		werrstr("corrupt log");
 		return -1;
 	}
@@ -374,16 +547,20 @@ Nextblk:
 			dropblk(b);
 			dprint("log@%d: chain %B\n", i, bp);
 			goto Nextblk;
+		case LogUnit:
+			dprint("log@%d: unit %lld\n", i, off);
+			a->unit = off;
+			break;
 		case LogAlloc:
 		case LogAlloc1:
-			len = (op >= Log2wide) ? UNPACK64(d+8) : Blksz;
+			len = (op >= Log2wide) ? UNPACK64(d+8) : a->unit;
 			dprint("log@%d alloc: %llx+%llx\n", i, off, len);
 			if(grabrange(a->free, off & ~0xff, len) == -1)
 				return -1;
 			break;
 		case LogFree:
 		case LogFree1:
-			len = (op >= Log2wide) ? UNPACK64(d+8) : Blksz;
+			len = (op >= Log2wide) ? UNPACK64(d+8) : a->unit;
 			dprint("log@%d free: %llx+%llx\n", i, off, len);
 			if(freerange(a->free, off & ~0xff, len) == -1)
 				return -1;
@@ -421,8 +598,9 @@ compresslog(Arena *a)
 	 * because otherwise we have a deadlock
 	 * allocating the block.
 	 */
-	if((ba = blkalloc_lk(a, 1)) == -1)
+	if((ba = blkalloc_lk(a, Blksz, 1)) == -1)
 		return -1;
+	a->nlog++;
 	if((b = cachepluck()) == nil)
 		return -1;
 	initblk(b, ba, Tlog);
@@ -462,10 +640,11 @@ compresslog(Arena *a)
 	 * so we don't record this block as
 	 * available when we compress the log.
 	 */
-	if((ba = blkalloc_lk(a, 1)) == -1){
+	if((ba = blkalloc_lk(a, Blksz, 1)) == -1){
 		free(log);
 		return -1;
 	}
+	a->nlog++;
 	initblk(b, ba, Tlog);
 	for(r = (Arange*)avlmin(a->free); r != nil; r = (Arange*)avlnext(r)){
 		if(n == sz){
@@ -483,6 +662,9 @@ compresslog(Arena *a)
 	hd = b;
 	tl = b;
 	b->logsz = Loghashsz;
+	/* the units in the old log may differ */
+	if(logappend(a, a->unit, 0, LogUnit, &tl) == -1)
+		return -1;
 	for(i = 0; i < n; i++)
 		if(logappend(a, log[i].off, log[i].len, LogFree, &tl) == -1)
 			return -1;
@@ -522,10 +704,11 @@ compresslog(Arena *a)
 			}
 			lock(a);
 			cachedel(b->bp.addr);
-			if(blkdealloc_lk(ba) == -1){
+			if(blkdealloc_lk(a, ba, Blksz) == -1){
 				unlock(a);
 				return -1;
 			}
+			a->nlog--;
 			dropblk(b);
 			unlock(a);
 		}
@@ -543,7 +726,7 @@ compresslog(Arena *a)
  * the alloc log.
  */
 static vlong
-blkalloc_lk(Arena *a, int force)
+blkalloc_lk(Arena *a, vlong len, int force)
 {
 	Avltree *t;
 	Arange *r;
@@ -553,6 +736,10 @@ blkalloc_lk(Arena *a, int force)
 	r = (Arange*)t->root;
 	if(!force && a->size - a->used <= a->reserve)
 		return -1;
+	if(r != nil && r->len < len)
+		for(r = (Arange*)avlmin(t); r != nil; r = (Arange*)avlnext(r))
+			if(r->len >= len)
+				break;
 	if(r == nil){
 		fprint(2, "out of space");
 		abort();
@@ -566,48 +753,156 @@ blkalloc_lk(Arena *a, int force)
 	 * covers disjoint ranges
 	 */
 	b = r->off;
-	r->len -= Blksz;
-	r->off += Blksz;
+	r->len -= len;
+	r->off += len;
 	if(r->len == 0){
 		avldelete(t, r);
 		free(r);
 	}
-	a->used += Blksz;
+	a->used += len;
 	return b;
 }
 
 static int
-blkdealloc_lk(vlong b)
+blkdealloc_lk(Arena *a, vlong b, vlong len)
 {
-	Arena *a;
 	int r;
 
 	r = -1;
-	a = getarena(b);
-	if(freerange(a->free, b, Blksz) == -1)
+	if(freerange(a->free, b, len) == -1)
 		goto out;
-	if(logop(a, b, Blksz, LogFree) == -1)
+	if(logop(a, b, len, LogFree) == -1)
 		goto out;
-	a->used -= Blksz;
+	a->used -= len;
 	r = 0;
 out:
 	return r;
 }
 
+/*
+ * Takes the block at b out of the free
+ * list, if it's there.
+ */
+static int
+blkgrab_lk(Arena *a, vlong b)
+{
+	Arange *r, q;
+
+	if(a->size - a->used <= a->reserve)
+		return -1;
+	q.off = b;
+	q.len = a->unit;
+	r = (Arange*)avllookup(a->free, &q, -1);
+	if(r == nil || b + a->unit > r->off + r->len)
+		return -1;
+	if(grabrange(a->free, b, a->unit) == -1)
+		return -1;
+	a->used += a->unit;
+	return 0;
+}
+
+/*
+ * An arena is empty when everything but the
+ * header and the log blocks is free, which
+ * leaves at most one more free range than
+ * there are log blocks. Called with the
+ * arena locked.
+ */
+static int
+arenaempty(Arena *a)
+{
+	Arange *r;
+	vlong avail;
+	int n;
+
+	n = 0;
+	avail = 0;
+	for(r = (Arange*)avlmin(a->free); r != nil; r = (Arange*)avlnext(r)){
+		if(++n > a->nlog+1)
+			return 0;
+		avail += r->len;
+	}
+	return avail + a->nlog*Blksz == a->size - Blksz;
+}
+
+/*
+ * Hands an empty arena over to a unit that
+ * ran out of room, so the split between
+ * metadata, file tails and file data follows
+ * what gets written rather than what ream
+ * guessed. The last arena of each unit is
+ * kept, so every unit has somewhere to go.
+ */
+static int
+claimarena(int unit)
+{
+	Arena *a;
+	int i, j, n;
+
+	for(i = 0; i < fs->narena; i++){
+		a = &fs->arenas[i];
+		if(a->unit == unit)
+			continue;
+		n = 0;
+		for(j = 0; j < fs->narena; j++)
+			if(fs->arenas[j].unit == a->unit)
+				n++;
+		if(n == 1)
+			continue;
+		lock(a);
+		if(a->unit == unit || !arenaempty(a)){
+			unlock(a);
+			continue;
+		}
+		dprint("arena %d: unit %d => %d\n", i, a->unit, unit);
+		a->unit = unit;
+		if(logop(a, unit, 0, LogUnit) == -1){
+			unlock(a);
+			return -1;
+		}
+		unlock(a);
+		return 0;
+	}
+	werrstr("no empty arenas");
+	return -1;
+}
+
 static vlong
-blkalloc(int hint)
+blkalloc(int hint, int unit)
 {
 	Arena *a;
 	vlong b;
-	int tries;
+	int tries, claimed, u;
 
+	/*
+	 * File data needs an arena cut into
+	 * units of the size asked for. Everything
+	 * else goes into Blksz arenas first, and
+	 * spills into the data arenas once those
+	 * are full.
+	 */
 	tries = 0;
+	claimed = 0;
 Again:
+	/*
+	 * Nothing of the right unit has room:
+	 * try to grow the unit before spilling.
+	 */
+	if(tries == fs->narena && !claimed){
+		claimed = 1;
+		if(claimarena(unit) == 0)
+			tries = 0;
+	}
 	a = pickarena(hint, tries);
-	if(a == nil || tries == fs->narena){
+	if(a == nil || tries == 2*fs->narena){
 		werrstr("no empty arenas");
 		return -1;
 	}
+	u = a->unit;
+	if(u != unit && (hint == Traw || tries < fs->narena || u < Blksz)){
+		tries++;
+		goto Again;
+	}
 	/*
 	 * TODO: there's an extreme edge case
 	 * here.
@@ -622,11 +917,16 @@ Again:
 	 */
 	tries++;
 	lock(a);
-	if((b = blkalloc_lk(a, 0)) == -1){
+	/* claimarena may have changed it */
+	if(a->unit != u){
 		unlock(a);
 		goto Again;
 	}
-	if(logop(a, b, Blksz, LogAlloc) == -1){
+	if((b = blkalloc_lk(a, a->unit, 0)) == -1){
+		unlock(a);
+		goto Again;
+	}
+	if(logop(a, b, a->unit, LogAlloc) == -1){
 		unlock(a);
 		return -1;
 	}
@@ -651,6 +951,8 @@ initblk(Blk *b, vlong bp, int t)
 	b->bp.gen = fs->nextgen;
 	switch(t){
 	case Traw:
+		b->data = rawbuf(b);
+		break;
 	case Tarena:
 		b->data = b->buf;
 		break;
@@ -659,10 +961,8 @@ initblk(Blk *b, vlong bp, int t)
 		b->data = b->buf + Loghdsz;
 		break;
 	case Tpivot:
-		b->data = b->buf + Pivhdsz;
-		break;
 	case Tleaf:
-		b->data = b->buf + Leafhdsz;
+		b->data = nodebuf(b);
 		break;
 	}
 	b->fnext = nil;
@@ -672,8 +972,11 @@ initblk(Blk *b, vlong bp, int t)
 	b->valsz = 0;
 	b->nbuf = 0;
 	b->bufsz = 0;
+	b->pvalsz = 0;
+	b->pbufsz = 0;
 	b->logsz = 0;
 	b->lognxt = 0;
+	b->clen = 0;
 	b->alloced = getcallerpc(&b);
 
 	return b;
@@ -685,8 +988,71 @@ newblk(int t)
 	vlong bp;
 	Blk *b;
 
-	if((bp = blkalloc(t)) == -1)
+	if((bp = blkalloc(t, (t == Traw) ? fs->blksz : Blksz)) == -1)
+		return nil;
+	if((b = cachepluck()) == nil)
+		return nil;
+	initblk(b, bp, t);
+	b->alloced = getcallerpc(&t);
+	return b;
+}
+
+/*
+ * Allocates a data block that holds at least
+ * sz bytes. File tails that fit go into the
+ * smaller units of the fragment or metadata
+ * arenas, and fall back to a full block when
+ * those are full.
+ */
+Blk*
+newdatblk(vlong sz)
+{
+	vlong bp;
+	Blk *b;
+
+	bp = -1;
+	if(sz <= Fragsz)
+		bp = blkalloc(Traw, Fragsz);
+	if(bp == -1 && sz <= Blksz && Blksz < fs->blksz)
+		bp = blkalloc(Traw, Blksz);
+	if(bp == -1 && (bp = blkalloc(Traw, fs->blksz)) == -1)
+		return nil;
+	if((b = cachepluck()) == nil)
+		return nil;
+	initblk(b, bp, Traw);
+	b->alloced = getcallerpc(&sz);
+	return b;
+}
+
+/*
+ * Allocates the block at bp, so that data
+ * can be laid out back to back with what
+ * came before it. Returns nil if bp is
+ * already in use.
+ */
+Blk*
+newblkat(int t, vlong bp)
+{
+	Arena *a;
+	Blk *b;
+
+	if(bp < 0 || bp/fs->arenasz >= fs->narena)
+		return nil;
+	a = getarena(bp);
+	lock(a);
+	if(a->unit != ((t == Traw) ? fs->blksz : Blksz)){
+		unlock(a);
+		return nil;
+	}
+	if(blkgrab_lk(a, bp) == -1){
+		unlock(a);
+		return nil;
+	}
+	if(logop(a, bp, a->unit, LogAlloc) == -1){
+		unlock(a);
 		return nil;
+	}
+	unlock(a);
 	if((b = cachepluck()) == nil)
 		return nil;
 	initblk(b, bp, t);
@@ -708,13 +1074,73 @@ dupblk(Blk *b)
 	r->valsz = b->valsz;
 	r->nbuf = b->nbuf;
 	r->bufsz = b->bufsz;
+	r->pvalsz = b->pvalsz;
+	r->pbufsz = b->pbufsz;
 	r->logsz = b->logsz;
 	r->lognxt = b->lognxt;
 	r->alloced = getcallerpc(&b);
-	memcpy(r->buf, b->buf, sizeof(r->buf));
+	if(b->type == Tpivot || b->type == Tleaf)
+		memcpy(r->data, b->data, Nodesz);
+	else if(b->type == Traw)
+		memcpy(r->data, b->data, fs->blksz);
+	else
+		memcpy(r->buf, b->buf, sizeof(r->buf));
 	return r;
 }
 
+/*
+ * Moves a packed node into a fragment, stored
+ * compressed, if it fits in one: it then takes
+ * a quarter of the space and read bandwidth.
+ * Nothing points at a node until it has been
+ * finalized, so it's still free to move.
+ */
+static void
+lznode(Blk *b)
+{
+	char z[Fragsz];
+	int n, clen;
+	vlong bp;
+	Bptr old;
+
+	n = blkfill(b) + ((b->type == Tpivot) ? Pivhdsz : Leafhdsz);
+	if((clen = lzenc(z, Fragsz-4, b->buf, n)) == -1)
+		return;
+	if((bp = blkalloc(Traw, Fragsz)) == -1)
+		return;
+	old = b->bp;
+	b->bp.addr = bp;
+	freebp(nil, old);
+	PACK16(b->buf, Tlz);
+	PACK16(b->buf+2, clen);
+	memcpy(b->buf+4, z, clen);
+	memset(b->buf+4+clen, 0, Blksz-4-clen);
+	b->clen = clen;
+}
+
+/*
+ * Turns a compressed node back into the
+ * packed form that unpacknode expects.
+ */
+static int
+inflatenode(Blk *b)
+{
+	char buf[Blksz];
+	int n;
+
+	if(b->clen > rawsz(b->bp.addr) - 4)
+		return -1;
+	if((n = lzdec(buf, Blksz, b->buf+4, b->clen)) < Leafhdsz)
+		return -1;
+	memcpy(b->buf, buf, n);
+	memset(b->buf+n, 0, Blksz-n);
+	b->type = UNPACK16(b->buf);
+	b->clen = 0;
+	if(b->type != Tpivot && b->type != Tleaf)
+		return -1;
+	return 0;
+}
+
 void
 finalize(Blk *b)
 {
@@ -726,25 +1152,28 @@ finalize(Blk *b)
 	switch(b->type){
 	default:
 	case Tpivot:
-		PACK16(b->buf+2, b->nval);
-		PACK16(b->buf+4, b->valsz);
-		PACK16(b->buf+6, b->nbuf);
-		PACK16(b->buf+8, b->bufsz);
-		b->bp.hash = blkhash(b);
-		break;
 	case Tleaf:
-		PACK16(b->buf+2, b->nval);
-		PACK16(b->buf+4, b->valsz);
+		/* compressed nodes are already packed */
+		if(b->clen == 0){
+			packnode(b);
+			if(fs->lzmeta && !checkflag(b, Bfinal))
+				lznode(b);
+		}
+		mkindex(b);
 		b->bp.hash = blkhash(b);
 		break;
 	case Tlog:
 	case Tdead:
-		h = siphash(b->data + Loghashsz, Logspc-Loghashsz);
+		h = bufhash(b->data + Loghashsz, Logspc-Loghashsz);
 		PACK64(b->data, h);
 		b->bp.hash = blkhash(b);
 		break;
 	case Traw:
-		b->bp.hash = blkhash(b);
+		/* Xnosum in the extent says not to check it */
+		if(checkflag(b, Bnosum))
+			b->bp.hash = 0;
+		else
+			b->bp.hash = blkhash(b);
 		break;
 	case Tmagic:
 	case Tarena:
@@ -755,39 +1184,115 @@ finalize(Blk *b)
 	cacheins(b);
 }
 
-Blk*
-getblk(Bptr bp, int flg)
+/*
+ * Only the check for the block in the cache
+ * and the list of reads in flight happen under
+ * blklk. The read, the hash check and unpacking
+ * are done without it, so they overlap with
+ * other reads, and the block is published to
+ * the cache only once it's good. Readers of the
+ * same block wait for the first one.
+ */
+static Blk*
+fetchblk(Bptr bp, int flg, int clen)
 {
+	Fetch f, **pf;
 	uvlong h;
 	Blk *b;
-	int i;
+	int i, n;
 
 	i = ihash(bp.addr) % nelem(fs->blklk);
 	qlock(&fs->blklk[i]);
+Again:
 	if((b = cacheget(bp.addr)) != nil){
 		qunlock(&fs->blklk[i]);
 		return b;
 	}
-	if((b = readblk(bp.addr, flg)) == nil){
-		qunlock(&fs->blklk[i]);
-		return nil;
+	for(pf = &fs->fetching[i]; *pf != nil; pf = &(*pf)->next){
+		if((*pf)->addr == bp.addr){
+			rsleep(&fs->blkrz[i]);
+			goto Again;
+		}
 	}
+	f.addr = bp.addr;
+	f.next = fs->fetching[i];
+	fs->fetching[i] = &f;
+	qunlock(&fs->blklk[i]);
+
+	if((b = readblk(bp.addr, flg, clen)) == nil)
+		goto Done;
 	b->alloced = getcallerpc(&bp);
-	h = blkhash(b);
-	if((flg&GBnochk) == 0 && h != bp.hash){
-		fprint(2, "corrupt block %p %B: %.16llux != %.16llux\n", b, bp, h, bp.hash);
-		qunlock(&fs->blklk[i]);
+	if(b->type == Traw && (flg & GBnosum)){
+		/* only file data may go unchecked */
+		setflag(b, Bnosum);
+		h = bp.hash;
+	}else{
+		h = blkhash(b);
+		if((flg&GBnochk) == 0 && h != bp.hash){
+			fprint(2, "corrupt block %p %B: %.16llux != %.16llux\n", b, bp, h, bp.hash);
+			abort();
+		}
+	}
+	if(clen != 0){
+		if((n = lzdec(b->data, fs->blksz, b->zbuf, clen)) == -1){
+			fprint(2, "corrupt compressed block %p %B\n", b, bp);
+			abort();
+		}
+		memset(b->data+n, 0, fs->blksz-n);
+		/* only blocks we write need it, and the cache budget doesn't count it */
+		if(!fs->lz){
+			free(b->zbuf);
+			b->zbuf = nil;
+		}
+	}
+	if(b->type == Tlz && inflatenode(b) == -1){
+		fprint(2, "corrupt compressed node %p %B\n", b, bp);
+		abort();
+	}
+	if((b->type == Tpivot || b->type == Tleaf) && unpacknode(b) == -1){
+		fprint(2, "corrupt node %p %B: %r\n", b, bp);
 		abort();
-		return nil;
 	}
+	if(b->type == Tpivot || b->type == Tleaf)
+		mkindex(b);
 	b->bp.hash = h;
 	b->bp.gen = bp.gen;
-	cacheins(b);
+Done:
+	qlock(&fs->blklk[i]);
+	for(pf = &fs->fetching[i]; *pf != &f; pf = &(*pf)->next)
+		assert(*pf != nil);
+	*pf = f.next;
+	if(b != nil)
+		cacheins(b);
+	rwakeupall(&fs->blkrz[i]);
 	qunlock(&fs->blklk[i]);
-
 	return b;
 }
 
+Blk*
+getblk(Bptr bp, int flg)
+{
+	return fetchblk(bp, flg, 0);
+}
+
+/*
+ * Reads block i of an extent, inflating it
+ * if it was stored compressed.
+ */
+Blk*
+getextblk(Ext *x, int i)
+{
+	int flg;
+
+	flg = GBraw;
+	if(x->flag & Xnosum)
+		flg |= GBnosum;
+	if(x->codec == Znone)
+		return fetchblk(x->bp[i], flg, 0);
+	assert(x->codec == Zlz && i == 0);
+	return fetchblk(x->bp[i], flg, x->clen);
+}
+
 
 Blk*
 holdblk(Blk *b)
@@ -825,9 +1330,9 @@ blkfill(Blk *b)
 {
 	switch(b->type){
 	case Tpivot:
-		return 2*b->nbuf + b->bufsz +  2*b->nval + b->valsz;
+		return b->pbufsz + b->pvalsz;
 	case Tleaf:
-		return 2*b->nval + b->valsz;
+		return b->pvalsz;
 	default:
 		fprint(2, "invalid block @%lld\n", b->bp.addr);
 		abort();
@@ -871,6 +1376,81 @@ freeblk(Tree *t, Blk *b)
 	deferfree(t, b->bp, b);
 }
 
+/*
+ * A data block born after the last snapshot
+ * of the tree is referenced only by the tree's
+ * uncommitted state, so it may be overwritten
+ * in place instead of shadowed.
+ *
+ * We only do this once the sync procs have
+ * written it out: a block still sitting in
+ * the sync queue may be mid-write, and the
+ * queue owns its dirty flag.
+ */
+int
+canreuse(Tree *t, Blk *b)
+{
+	if(t == nil || t == &fs->snap)
+		return 0;
+	if(b->type != Traw || b->bp.gen <= t->gen)
+		return 0;
+	if(checkflag(b, Bdirty) || checkflag(b, Bwriting) || checkflag(b, Bfreed))
+		return 0;
+	return !fs->dedup || !dedupshared(b->bp.addr);
+}
+
+/*
+ * Checks that bp hasn't gone back to its
+ * arena, so that a dedup entry that outlived
+ * its block is never taken at its word.
+ */
+int
+blkinuse(vlong bp)
+{
+	Arange *r, q;
+	Arena *a;
+	int used;
+
+	a = getarena(bp);
+	q.off = bp;
+	q.len = a->unit;
+	lock(a);
+	r = (Arange*)avllookup(a->free, &q, -1);
+	used = (r == nil || bp >= r->off + r->len);
+	unlock(a);
+	return used;
+}
+
+/*
+ * Compares the data block at bp with b. The
+ * dedup table only suggests bp, so it's read
+ * around the cache: a stale entry must not
+ * leave some other block cached as file data.
+ * A cached copy is used if it holds file data.
+ */
+int
+blkmatch(vlong bp, Blk *b)
+{
+	static char *buf;
+	int n, same;
+	Blk *c;
+
+	if((c = cacheget(bp)) != nil){
+		same = c->type == Traw && c->clen == 0
+			&& memcmp(c->data, b->data, fs->blksz) == 0;
+		dropblk(c);
+		return same;
+	}
+	/* only the mutator dedups, so this can be shared */
+	if(buf == nil && (buf = malloc(fs->blksz)) == nil)
+		return 0;
+	n = rawsz(bp);
+	if(preadn(buf, n, bp) == -1)
+		return 0;
+	/* b is zeroed past its unit */
+	return memcmp(buf, b->data, n) == 0;
+}
+
 void
 epochstart(int tid)
 {
@@ -895,7 +1475,7 @@ epochclean(void)
 	ulong e, ge;
 	Bfree *p, *n;
 	Arena *a;
-	int i;
+	int i, kept;
 
 	ge = agetl(&fs->epoch);
 	for(i = 0; i < fs->nworker; i++){
@@ -913,10 +1493,13 @@ epochclean(void)
 	while(p != nil){
 		n = p->next;
 		a = getarena(p->bp.addr);
+		/* shared blocks only lose a reference */
+		kept = fs->dedup && dedupfree(p->bp);
 
 		lock(a);
 		cachedel(p->bp.addr);
-		blkdealloc_lk(p->bp.addr);
+		if(!kept)
+			blkdealloc_lk(a, p->bp.addr, a->unit);
 		if(p->b != nil)
 			dropblk(p->b);
 		unlock(a);
@@ -926,13 +1509,29 @@ epochclean(void)
 	}
 }
 
+/*
+ * Blocks go out one sync generation at a time.
+ * Within one, they go in the order they were
+ * queued, or with fs->elevator, in a sweep up
+ * the disk: nothing refers to them until the
+ * arenas are synced, so the order only matters
+ * when an address is queued twice, and then
+ * the last one queued must win. The marker
+ * closing a generation goes last either way.
+ */
 int
 blkcmp(Blk *a, Blk *b)
 {
 	if(a->qgen != b->qgen)
 		return (a->qgen < b->qgen) ? -1 : 1;
-	if(a->bp.addr != b->bp.addr)
-		return (a->bp.addr < b->bp.addr) ? -1 : 1;
+	if(fs->elevator){
+		if((a->type == Tmagic) != (b->type == Tmagic))
+			return (a->type == Tmagic) ? 1 : -1;
+		if(a->bp.addr != b->bp.addr)
+			return (a->bp.addr < b->bp.addr) ? -1 : 1;
+	}
+	if(a->qseq != b->qseq)
+		return (a->qseq < b->qseq) ? -1 : 1;
 	return 0;
 }
 
@@ -940,12 +1539,23 @@ void
 enqueue(Blk *b)
 {
 	Arena *a;
+	int n;
 
-	b->qgen = aincv(&fs->qgen, 1);
-	a = getarena(b->bp.addr);
+	b->qgen = agetv(&fs->syncgen);
+	b->qseq = aincv(&fs->qgen, 1);
 	assert(checkflag(b, Bdirty));
 	holdblk(b);
+	/* finalizing a node may move it */
 	finalize(b);
+	diskbuf(b, &n);
+	aincv(&fs->dirtybytes, n);
+	if(aincv(&fs->dirtyblk, 1) == 0){
+		/* aincv returns the old count; runtasks sleeps at zero */
+		qlock(&fs->dirtylk);
+		rwakeup(&fs->dirtyrz);
+		qunlock(&fs->dirtylk);
+	}
+	a = getarena(b->bp.addr);
 	qput(a->sync, b);
 }
 
@@ -954,6 +1564,7 @@ qinit(Syncq *q)
 {
 	q->fullrz.l = &q->lk;
 	q->emptyrz.l = &q->lk;
+	q->idlerz.l = &q->lk;
 	q->nheap = 0;
 	q->heapsz = fs->cmax;
 	if((q->heap = malloc(q->heapsz*sizeof(Blk*))) == nil)
@@ -976,20 +1587,30 @@ qput(Syncq *q, Blk *b)
 	}
 	q->heap[i] = b;
 	q->nheap++;
+	if(q->nheap > q->maxheap)
+		q->maxheap = q->nheap;
 	rwakeup(&q->emptyrz);
 	qunlock(&q->lk);
 }
 
+/*
+ * Takes the first block off the heap, and
+ * counts it in flight until qdone. Called
+ * with q->lk held, on a heap that isn't
+ * empty. The generation is returned in gen,
+ * since b->qgen may change under us if the
+ * block is queued again.
+ */
 static Blk*
-qpop(Syncq *q)
+qtake(Syncq *q, vlong *gen)
 {
 	int i, l, r, m;
 	Blk *b, *t;
 
-	qlock(&q->lk);
-	while(q->nheap == 0)
-		rsleep(&q->emptyrz);
 	b = q->heap[0];
+	*gen = b->qgen;
+	if(b->type != Tmagic)
+		q->inflight[*gen&1]++;
 	if(--q->nheap == 0)
 		goto Out;
 
@@ -1012,36 +1633,230 @@ qpop(Syncq *q)
 	}
 Out:
 	rwakeup(&q->fullrz);
+	return b;
+}
+
+static Blk*
+qpop(Syncq *q, vlong *gen)
+{
+	Blk *b;
+
+	qlock(&q->lk);
+	while(q->nheap == 0)
+		rsleep(&q->emptyrz);
+	b = qtake(q, gen);
+	qunlock(&q->lk);
+	return b;
+
+}
+
+/*
+ * A freed block only needs writing if some
+ * header may point at it: anything queued
+ * before the last sync started is still part
+ * of the generation being committed. The flag
+ * is checked first, so a free after a sync
+ * sees its syncgen.
+ */
+static int
+qskip(Blk *b)
+{
+	return checkflag(b, Bfreed) && b->qgen == agetv(&fs->syncgen);
+}
+
+static void
+qdone(Syncq *q, vlong gen)
+{
+	qlock(&q->lk);
+	if(--q->inflight[gen&1] == 0)
+		rwakeupall(&q->idlerz);
+	qunlock(&q->lk);
+}
+
+/*
+ * With more than one proc on a queue, the
+ * blocks popped ahead of a generation's marker
+ * may still be in flight when it's popped.
+ * Only the generation being synced and the
+ * one after it can be in the queue, so two
+ * counts are enough.
+ */
+static void
+qdrain(Syncq *q, vlong gen)
+{
+	qlock(&q->lk);
+	while(q->inflight[gen&1] != 0)
+		rsleep(&q->idlerz);
+	qunlock(&q->lk);
+}
+
+/*
+ * Pops the next block only if it goes to disk
+ * right at addr and fits in room bytes, so it
+ * can join the write being gathered. Never
+ * waits for one.
+ */
+static Blk*
+qpopnext(Syncq *q, vlong addr, int room, vlong *gen)
+{
+	Blk *b;
+	int n;
+
+	b = nil;
+	qlock(&q->lk);
+	if(q->nheap == 0)
+		goto Out;
+	b = q->heap[0];
+	if(b->type == Tmagic || qskip(b) || b->bp.addr != addr){
+		b = nil;
+		goto Out;
+	}
+	diskbuf(b, &n);
+	if(n > room){
+		b = nil;
+		goto Out;
+	}
+	b = qtake(q, gen);
+Out:
 	qunlock(&q->lk);
 	return b;
+}
+
+/*
+ * Writes out b, and any blocks queued right
+ * behind it on disk, as one pwrite of up to
+ * Syncmax bytes. There's no pwritev, so the
+ * blocks are copied into buf.
+ */
+static void
+syncrun(Syncq *q, Blk *b, vlong gen, char *buf)
+{
+	Blk *bl[Syncmax/Fragsz];
+	vlong gl[Syncmax/Fragsz];
+	int i, nb, n, m;
+	vlong off, t0;
+	char *p;
 
+	off = b->bp.addr;
+	bl[0] = b;
+	gl[0] = gen;
+	nb = 1;
+	diskbuf(b, &n);
+	while(nb < nelem(bl) && (b = qpopnext(q, off+n, Syncmax-n, &gen)) != nil){
+		bl[nb] = b;
+		gl[nb] = gen;
+		nb++;
+		diskbuf(b, &m);
+		n += m;
+	}
+	t0 = nsec();
+	if(nb == 1){
+		if(syncblk(bl[0]) == -1)
+			goto Error;
+	}else{
+		n = 0;
+		for(i = 0; i < nb; i++){
+			assert(checkflag(bl[i], Bfinal));
+			setflag(bl[i], Bwriting);
+			clrflag(bl[i], Bdirty);
+			p = diskbuf(bl[i], &m);
+			memcpy(buf+n, p, m);
+			n += m;
+		}
+		if(pwrite(fs->fd, buf, n, off) != n)
+			goto Error;
+		for(i = 0; i < nb; i++)
+			clrflag(bl[i], Bwriting);
+	}
+	aincv(&q->wtime, nsec() - t0);
+	aincv(&q->nwrite, 1);
+	aincv(&q->wblk, nb);
+	aincv(&q->wbytes, n);
+	for(i = 0; i < nb; i++){
+		dropblk(bl[i]);
+		qdone(q, gl[i]);
+	}
+	return;
+Error:
+	ainc(&fs->broken);
+	fprint(2, "write: %r\n");
+	abort();
+}
+
+/*
+ * Writes the arena tails and headers saved
+ * by sync, once every block of the generation
+ * is on disk. Called by the sync proc that
+ * drains the last queue, with fs->synclk held.
+ */
+static void
+synccommit(void)
+{
+	Stats *s;
+	Arena *a;
+	vlong t;
+	int i;
+
+	for(i = 0; i < fs->narena; i++){
+		a = &fs->arenas[i];
+		if(pwrite(fs->fd, a->cmt, Blksz, a->cmttail) != Blksz)
+			sysfatal("sync arena: %r");
+		if(pwrite(fs->fd, a->cmt+Blksz, Blksz, a->b->bp.addr) != Blksz)
+			sysfatal("sync arena: %r");
+	}
+	t = nsec() - fs->syncstart;
+	s = &fs->stats;
+	s->nsync++;
+	s->syncblk += fs->syncblk;
+	s->syncbytes += fs->syncbytes;
+	s->syncns += t;
+	s->lastblk = fs->syncblk;
+	s->lastbytes = fs->syncbytes;
+	s->lastns = t;
+	if(t > s->maxns)
+		s->maxns = t;
 }
 
 void
 runsync(int, void *p)
 {
 	Syncq *q;
+	char *buf;
+	vlong gen;
 	Blk *b;
 
 	q = p;
+	if((buf = malloc(Syncmax)) == nil)
+		sysfatal("alloc sync buf: %r");
 	while(1){
-		b = qpop(q);
+		b = qpop(q, &gen);
 		if(b->type == Tmagic){
+			qdrain(q, gen);
 			qlock(&fs->synclk);
-			if(--fs->syncing == 0)
+			if(--fs->syncing == 0){
+				synccommit();
 				rwakeupall(&fs->syncrz);
-			qunlock(&fs->synclk);
-		}else if(!checkflag(b, Bfreed)){
-			if(syncblk(b) == -1){
-				ainc(&fs->broken);
-				fprint(2, "write: %r\n");
-				abort();
 			}
-		}
-		dropblk(b);
+			qunlock(&fs->synclk);
+			dropblk(b);
+		}else if(qskip(b)){
+			dropblk(b);
+			qdone(q, gen);
+		}else
+			syncrun(q, b, gen, buf);
 	}
 }
 
+/*
+ * Starts a sync of everything queued so far,
+ * and returns without waiting for the disk:
+ * the mutator goes on with the next generation
+ * while this one is written. The arena state
+ * is saved now, and committed by the sync
+ * procs when the generation has drained. Only
+ * one generation commits at a time, so this
+ * waits for the last one first.
+ */
 void
 sync(void)
 {
@@ -1050,23 +1865,48 @@ sync(void)
 	int i;
 
 	qlock(&fs->synclk);
+	while(fs->syncing != 0)
+		rsleep(&fs->syncrz);
+	fs->syncstart = nsec();
+	fs->syncblk = agetv(&fs->dirtyblk);
+	aincv(&fs->dirtyblk, -fs->syncblk);
+	fs->syncbytes = agetv(&fs->dirtybytes);
+	aincv(&fs->dirtybytes, -fs->syncbytes);
+	asetl(&fs->syncpending, 0);
+	for(i = 0; i < fs->narena; i++){
+		a = &fs->arenas[i];
+		if(a->cmt == nil && (a->cmt = malloc(2*Blksz)) == nil)
+			sysfatal("alloc sync arena: %r");
+		finalize(a->tail);
+		memcpy(a->cmt, a->tail->buf, Blksz);
+		a->cmttail = a->tail->bp.addr;
+		packarena(a->b->data, Blksz, a, fs);
+		finalize(a->b);
+		memcpy(a->cmt+Blksz, a->b->buf, Blksz);
+	}
 	fs->syncing = fs->nsyncers;
 	for(i = 0; i < fs->nsyncers; i++){
 		b = cachepluck();
 		b->type = Tmagic;
 		lock(&fs->freelk);
 		unlock(&fs->freelk);
+		b->qgen = agetv(&fs->syncgen);
+		b->qseq = aincv(&fs->qgen, 1);
 		qput(&fs->syncq[i], b);
 	}
+	/* blocks queued from here on wait for the next sync */
+	aincv(&fs->syncgen, 1);
+	qunlock(&fs->synclk);
+}
+
+/*
+ * Waits for the last sync to commit.
+ */
+void
+syncwait(void)
+{
+	qlock(&fs->synclk);
 	while(fs->syncing != 0)
 		rsleep(&fs->syncrz);
-	for(i = 0; i < fs->narena; i++){
-		a = &fs->arenas[i];
-		finalize(a->tail);
-		if(syncblk(a->tail) == -1)
-			sysfatal("sync arena: %r");
-		if(syncarena(a) == -1)
-			sysfatal("sync arena: %r");
-	}
 	qunlock(&fs->synclk);
 }
@@ -145,13 +145,70 @@ showusers(int fd, char**, int)
 static void
 stats(int fd, char**, int)
 {
+	vlong nw, nb;
+	Syncq *q;
 	Stats *s;
+	int i;
 
 	s = &fs->stats;
 	fprint(fd, "stats:\n");
 	fprint(fd, "	cache hits:	%lld\n", s->cachehit);
 	fprint(fd, "	cache lookups:	%lld\n", s->cachelook);
 	fprint(fd, "	cache ratio:	%f\n", (double)s->cachehit/(double)s->cachelook);
+	nw = 0;
+	nb = 0;
+	for(i = 0; i < fs->nsyncers; i++){
+		q = &fs->syncq[i];
+		nw += q->nwrite;
+		nb += q->wbytes;
+	}
+	fprint(fd, "	sync writes:	%lld\n", nw);
+	fprint(fd, "	sync bytes:	%lld\n", nb);
+	if(nw > 0)
+		fprint(fd, "	avg write:	%lld\n", nb/nw);
+	fprint(fd, "	syncs:	%lld\n", s->nsync);
+	if(s->nsync > 0){
+		fprint(fd, "	avg sync:	%lld blocks, %lld bytes, %lld ms\n",
+			s->syncblk/s->nsync, s->syncbytes/s->nsync, s->syncns/s->nsync/(Nsec/1000));
+		fprint(fd, "	last sync:	%lld blocks, %lld bytes, %lld ms\n",
+			s->lastblk, s->lastbytes, s->lastns/(Nsec/1000));
+		fprint(fd, "	max sync:	%lld ms\n", s->maxns/(Nsec/1000));
+	}
+	fprint(fd, "	sync procs:	%ld queues, %d deep\n", fs->nsyncers, fs->syncdepth);
+	for(i = 0; i < fs->nsyncers; i++){
+		q = &fs->syncq[i];
+		fprint(fd, "	syncq[%d]:	depth %d, peak %d, writes %lld, blocks %lld, bytes %lld",
+			i, q->nheap, q->maxheap, q->nwrite, q->wblk, q->wbytes);
+		if(q->wtime > 0)
+			fprint(fd, ", %.2f MiB/s", (double)q->wbytes/MiB / ((double)q->wtime/Nsec));
+		fprint(fd, "\n");
+	}
+}
+
+static void
+benchcmp(int fd, char **ap, int na)
+{
+	int n;
+
+	n = (na == 1) ? atoi(ap[0]) : 1000000;
+	if(n <= 0){
+		fprint(fd, "bad count %s\n", ap[0]);
+		return;
+	}
+	benchkeycmp(fd, n);
+}
+
+static void
+benchsum(int fd, char **ap, int na)
+{
+	int n;
+
+	n = (na == 1) ? atoi(ap[0]) : 100000;
+	if(n <= 0){
+		fprint(fd, "bad count %s\n", ap[0]);
+		return;
+	}
+	benchhash(fd, n);
 }
 
 static void
@@ -225,6 +282,48 @@ Out:
 	closesnap(t);
 }
 
+static void
+holes(int fd, char **ap, int na)
+{
+	char *e, pfx[9];
+	vlong qid, off;
+	Tree *t;
+	Scan s;
+	Kvp kv;
+	Ext x;
+	int done;
+
+	if((t = openlabel((na == 2) ? ap[1] : "main")) == nil){
+		fprint(fd, "could not open snap\n");
+		return;
+	}
+	qid = strtoll(ap[0], nil, 16);
+	pfx[0] = Kdat;
+	PACK64(pfx+1, qid);
+	if((e = btscan(t, &s, pfx, sizeof(pfx))) != nil){
+		fprint(fd, "scan failed: %s\n", e);
+		goto Out;
+	}
+	off = 0;
+	while(1){
+		if((e = btnext(&s, &kv, &done)) != nil){
+			fprint(fd, "scan failed: %s\n", e);
+			break;
+		}
+		if(done)
+			break;
+		x.off = UNPACK64(kv.k+9);
+		unpackext(&x, kv.v, kv.nv);
+		if(x.off > off)
+			fprint(fd, "hole %lld %lld\n", off, x.off);
+		off = x.off + x.nblk*fs->blksz;
+		fprint(fd, "data %lld %lld\n", x.off, off);
+	}
+	btdone(&s);
+Out:
+	closesnap(t);
+}
+
 static void
 showblkdump(int fd, char **ap, int na)
 {
@@ -257,6 +356,22 @@ help(int fd, char**, int)
 		"	create or update a new snapshot based off old\n"
 		"check\n"
 		"	run a consistency check on the file system\n"
+		"compact [name [budget]]\n"
+		"	rewrite up to budget nodes of a mounted tree in\n"
+		"	key order, resuming where the last pass stopped\n"
+		"nosum name on|off\n"
+		"	store the data blocks that a mounted tree writes\n"
+		"	from now on without checksums. Metadata is always\n"
+		"	checksummed. Meant for scratch data\n"
+		"holes qid [name]\n"
+		"	list the data and hole ranges of a file, in the\n"
+		"	main snap or the one named. Ranges past the last\n"
+		"	data range are holes up to the file length\n"
+		"synctune [poll|age|dirty|cache value]\n"
+		"	show or set when syncs happen: after dirty data\n"
+		"	is age ms old, when dirty bytes are queued, or\n"
+		"	when cache percent of the cache is queued. The\n"
+		"	checks run every poll ms while there's dirt\n"
 		"users\n"
 		"	reload user table from /adm/users in the main snap\n"
 		"show\n"
@@ -270,25 +385,123 @@ help(int fd, char**, int)
 		"		the contents of the tree associated with a\n"
 		"		snapshot. The special name 'snap' shows the\n"
 		"		snapshot tree\n"
+		"	shape [name]\n"
+		"		the number of nodes and their fill at each\n"
+		"		level of the tree\n"
 		"	snap\n"
 		"		the summary of the existing snapshots\n"
 		"	fid\n"
 		"		the summary of open fids\n"
 		"	users\n"
-		"		the known user file\n";
+		"		the known user file\n"
+		"bench keycmp [n]\n"
+		"	time n key comparisons, default 1000000\n"
+		"bench hash [n]\n"
+		"	time n block checksums with each hash, default 100000\n";
 	fprint(fd, "%s", msg);
 }
 
+static void
+compact(int fd, char **ap, int na)
+{
+	Fmsg *m;
+	Amsg *a;
+
+	m = mallocz(sizeof(Fmsg), 1);
+	a = mallocz(sizeof(Amsg), 1);
+	if(m == nil || a == nil){
+		fprint(fd, "alloc compact msg: %r\n");
+		free(m);
+		free(a);
+		return;
+	}
+	strecpy(a->label, a->label+sizeof(a->label), (na > 0) ? ap[0] : "main");
+	a->budget = (na > 1) ? atoi(ap[1]) : 1024;
+	a->op = AOcompact;
+	a->fd = fd;
+	m->a = a;
+	chsend(fs->wrchan, m);
+}
+
+static void
+nosum(int fd, char **ap, int)
+{
+	Fmsg *m;
+	Amsg *a;
+	int on;
+
+	if(strcmp(ap[1], "on") == 0)
+		on = 1;
+	else if(strcmp(ap[1], "off") == 0)
+		on = 0;
+	else{
+		fprint(fd, "nosum: %s: want on or off\n", ap[1]);
+		return;
+	}
+	m = mallocz(sizeof(Fmsg), 1);
+	a = mallocz(sizeof(Amsg), 1);
+	if(m == nil || a == nil){
+		fprint(fd, "alloc nosum msg: %r\n");
+		free(m);
+		free(a);
+		return;
+	}
+	strecpy(a->label, a->label+sizeof(a->label), ap[0]);
+	a->nosum = on;
+	a->op = AOnosum;
+	a->fd = fd;
+	m->a = a;
+	chsend(fs->wrchan, m);
+}
+
+static void
+synctune(int fd, char **ap, int na)
+{
+	vlong v;
+
+	if(na == 1){
+		fprint(fd, "synctune: want a value for %s\n", ap[0]);
+		return;
+	}
+	if(na == 2){
+		v = strtoll(ap[1], nil, 0);
+		if(v <= 0){
+			fprint(fd, "synctune: bad value %s\n", ap[1]);
+			return;
+		}
+		if(strcmp(ap[0], "poll") == 0)
+			fs->syncpoll = v;
+		else if(strcmp(ap[0], "age") == 0)
+			fs->syncage = v;
+		else if(strcmp(ap[0], "dirty") == 0)
+			fs->syncdirty = v;
+		else if(strcmp(ap[0], "cache") == 0 && v <= 100)
+			fs->synccache = v;
+		else{
+			fprint(fd, "synctune: bad setting %s %s\n", ap[0], ap[1]);
+			return;
+		}
+	}
+	fprint(fd, "poll:	%ld ms\n", fs->syncpoll);
+	fprint(fd, "age:	%ld ms\n", fs->syncage);
+	fprint(fd, "dirty:	%lld bytes\n", fs->syncdirty);
+	fprint(fd, "cache:	%d%%\n", fs->synccache);
+}
+
 Cmd cmdtab[] = {
 	/* admin */
 	{.name="sync",	.sub=nil,	.minarg=0, .maxarg=0, .fn=syncfs},
 	{.name="halt",	.sub=nil,	.minarg=0, .maxarg=0, .fn=haltfs},
 	{.name="snap",	.sub=nil,	.minarg=2, .maxarg=2, .fn=snapfs},
 	{.name="check",	.sub=nil,	.minarg=1, .maxarg=1, .fn=fsckfs},
+	{.name="compact", .sub=nil,	.minarg=0, .maxarg=2, .fn=compact},
+	{.name="nosum",	.sub=nil,	.minarg=2, .maxarg=2, .fn=nosum},
 	{.name="help",	.sub=nil,	.minarg=0, .maxarg=0, .fn=help},
+	{.name="holes",	.sub=nil,	.minarg=1, .maxarg=2, .fn=holes},
 	{.name="df",	.sub=nil, 	.minarg=0, .maxarg=0, .fn=showdf},
 	{.name="users",	.sub=nil,	.minarg=0, .maxarg=1, .fn=refreshusers},
 	{.name="stats", .sub=nil,	.minarg=0, .maxarg=0, .fn=stats},
+	{.name="synctune", .sub=nil,	.minarg=0, .maxarg=2, .fn=synctune},
 
 	/* debugging */
 	{.name="show",	.sub="cache",	.minarg=0, .maxarg=0, .fn=showcache},
@@ -297,10 +510,13 @@ Cmd cmdtab[] = {
 	{.name="show",	.sub="free",	.minarg=0, .maxarg=0, .fn=showfree},
 	{.name="show",	.sub="snap",	.minarg=0, .maxarg=1, .fn=showsnap},
 	{.name="show",	.sub="tree",	.minarg=0, .maxarg=1, .fn=showtree},
+	{.name="show",	.sub="shape",	.minarg=0, .maxarg=1, .fn=showshape},
 	{.name="show",	.sub="users",	.minarg=0, .maxarg=0, .fn=showusers},
 	{.name="show",	.sub="blk",	.minarg=0, .maxarg=1, .fn=showblkdump},
 	{.name="show",	.sub="blks",	.minarg=1, .maxarg=1, .fn=showblkdump},
 	{.name="debug",	.sub=nil,	.minarg=0, .maxarg=1, .fn=setdbg},
+	{.name="bench",	.sub="keycmp",	.minarg=0, .maxarg=1, .fn=benchcmp},
+	{.name="bench",	.sub="hash",	.minarg=0, .maxarg=1, .fn=benchsum},
 
 	{.name=nil, .sub=nil},
 };
@@ -9,6 +9,7 @@ typedef struct Val	Val;
 typedef struct Kvp	Kvp;
 typedef struct Xdir	Xdir;
 typedef struct Bptr	Bptr;
+typedef struct Ext	Ext;
 typedef struct Bfree	Bfree;
 typedef struct Scan	Scan;
 typedef struct Dent	Dent;
@@ -25,6 +26,7 @@ typedef struct Mount	Mount;
 typedef struct User	User;
 typedef struct Stats	Stats;
 typedef struct Conn	Conn;
+typedef struct Fetch	Fetch;
 
 enum {
 	KiB	= 1024ULL,
@@ -33,12 +35,20 @@ enum {
 	TiB	= 1024ULL*GiB,
 
 	Lgblk	= 13,
-	Blksz	= (1ULL<<Lgblk),
+	Blksz	= (1ULL<<Lgblk),	/* metadata; file data is fs->blksz */
+	Maxblksz	= 128*KiB,
+	Fragsz	= Blksz/4,		/* allocation unit for file tails */
 
 	Nrefbuf	= 1024,			/* number of ref incs before syncing */
 	Nfidtab	= 1024,			/* number of fit hash entries */
 	Ndtab	= 1024,			/* number of dir tab entries */
 	Max9p	= 16*KiB,		/* biggest message size we're willing to negotiate */
+	Syncmax	= 256*KiB,		/* biggest write a sync proc gathers */
+	Syncdepth	= 4,			/* default procs per queue on a disk */
+	Syncpoll	= 100,			/* ms between checks for a sync while dirty */
+	Syncage	= 5000,			/* ms dirty blocks may wait for a sync */
+	Syncdirty	= 64*MiB,		/* bytes queued that force a sync */
+	Synccache	= 25,			/* percent of the cache queued that forces one */
 	Nsec	= 1000LL*1000*1000,	/* nanoseconds to the second */
 	Maxname	= 256,			/* maximum size of a name element */
 	Maxent	= 9+Maxname+1,		/* maximum size of ent key, with terminator */
@@ -53,28 +63,52 @@ enum {
 	Inlmax	= 512,			/* inline data limit */
 	Ptrsz	= 24,			/* off, hash, gen */
 	Pptrsz	= 26,			/* off, hash, gen, fill */
+	Extmax	= 16,			/* data blocks in an extent */
+	Extsz	= Ptrsz + 8*(Extmax-1),	/* extent: ptr, more hashes */
+	Zextsz	= Ptrsz + 1 + 4,	/* compressed block: ptr, codec, len */
 	Fillsz	= 2,			/* block fill count */
 	Offksz	= 17,			/* type, qid, off */
 	Snapsz	= 9,			/* tag, snapid */
 	Dpfxsz	= 9,
 	Ndead	= 8,			/* number of deadlist heads */
 	Deadsz	= 8+8+8,		/* prev, head, hash */
-	Treesz	= 4+4+8+Ptrsz+Ndead*Deadsz,	/* ref, height, gen, root, deadlist */
+	Treesz	= 4+4+8+Ptrsz+Ndead*Deadsz+4,	/* ref, height, gen, root, deadlist, flag */
 	Kvmax	= Keymax + Inlmax,	/* Key and value */
 	Kpmax	= Keymax + Ptrsz,	/* Key and pointer */
 	Wstatmax = 4+8+8+8,		/* mode, size, atime, mtime */
 	
 
-	Pivhdsz		= 10,
-	Leafhdsz	= 6,
+	Pivhdsz		= 6,	/* type, nval, nbuf */
+	Leafhdsz	= 4,	/* type, nval */
 	Loghdsz		= 2,
 	Loghashsz	= 8,
 	Rootsz		= 4+Ptrsz,	/* root pointer */
 	Pivsz		= Blksz - Pivhdsz,
-	Bufspc		= (Blksz - Pivhdsz) / 2,
-	Pivspc		= Blksz - Pivhdsz - Bufspc,
 	Logspc		= Blksz - Loghdsz,
-	Leafspc 	= Blksz - Leafhdsz,
+
+	/*
+	 * Nodes are unpacked into a buffer of Nodesz
+	 * bytes when loaded. Packing never shrinks
+	 * a node to less than half its size, so the
+	 * limits below only need to be checked on
+	 * the packed size, which must fit in a block.
+	 * The packed limits leave Keymax of slack,
+	 * because the first key of a node split off
+	 * can't share a prefix.
+	 *
+	 * How pivots split Pkpivtot between their
+	 * values and buffer is picked at ream time,
+	 * and kept in fs->bufspc and fs->pivspc.
+	 */
+	Nodesz		= 2*Blksz,
+	Leafspc 	= Nodesz,
+	Pkleafspc	= Blksz - Leafhdsz - Keymax,
+	Pkpivtot	= Blksz - Pivhdsz - 2*Keymax,
+	Bufpct		= 50,		/* default percent of Pkpivtot for the buffer */
+	Nodeix		= Blksz / 5,	/* max entries: packed vals take >= 5 bytes */
+	Bloomsz		= 256,		/* bytes of pivot buffer filter */
+	Minfill		= 40,		/* percent fill we try to keep nodes above */
+	Packfill	= 75,		/* percent fill compaction packs leaves to */
 	Msgmax  	= 1 + (Kvmax > Kpmax ? Kvmax : Kpmax)
 };
 
@@ -88,12 +122,15 @@ enum {
 	 * ptr:  off[8] hash[8] -- a key for an Dir block.
 	 * dir:  serialized Xdir
 	 */
-	Kdat,	/* qid[8] off[8] => ptr[16]:	pointer to data page */
+	Kdat,	/* qid[8] off[8] => ptr[24] hash[8]*:	extent of data pages */
 	Kent,	/* pqid[8] name[n] => dir[n]:	serialized Dir */
 	Klabel,	/* name[] => snapid[]:		snapshot label */
 	Ktref,	/* tag[8] = snapid[]		scratch snapshot label */
 	Ksnap,	/* sid[8] => ref[8], tree[52]:	snapshot root */
 	Ksuper,	/* qid[8] => Kent:		parent dir */
+	Kinl,	/* qid[8] => data[n]:		contents of a small file */
+	Kdedup,	/* hash[8] => ptr[24]:		data block with this hash */
+	Kdref,	/* addr[8] => ref[8]:		extra refs to a shared block */
 };
 
 enum {
@@ -101,6 +138,22 @@ enum {
 	Bfinal	= 1 << 1,
 	Bfreed	= 1 << 2,
 	Bcached	= 1 << 3,
+	Bnosum	= 1 << 4,	/* data block stored without a hash */
+	Bwriting	= 1 << 5,	/* clean, but the write is in flight */
+};
+
+enum {
+	TFnosum	= 1 << 0,	/* tree's data blocks skip checksums */
+};
+
+/*
+ * Extent flags ride in the low bits of the
+ * packed address, which are always zero since
+ * blocks are at least Fragsz aligned.
+ */
+enum {
+	Xnosum	= 1 << 0,	/* blocks are stored without a hash */
+	Xflags	= Xnosum,
 };
 
 enum {
@@ -162,8 +215,8 @@ extern char Enempty[];
  * and refcount blocks.
  *
  * The superblock has this layout:
- *	version[8]	always "gefs0001"
- *	blksz[4]	block size in bytes
+ *	version[8]	always "gefs0002"
+ *	blksz[4]	size of file data blocks
  *	bufsz[4]	portion of leaf nodes
  *			allocated to buffers,
  *			in bytes
@@ -181,6 +234,18 @@ extern char Enempty[];
  *
  *	log[8]		The head of the alloc log
  *	logh[8]		The hash of the alloc log
+ *	size[8]		The size of the arena
+ *	used[8]		The bytes allocated
+ *	unit[4]		The allocation unit: Blksz
+ *			for metadata arenas, blksz
+ *			for data arenas, Fragsz
+ *			for file tails. Empty arenas
+ *			may change it; the log has
+ *			the last word.
+ *	hash[4]		The block checksum, Hsip
+ *			or Hxx
+ *	dedup[4]	Nonzero once data blocks
+ *			may be shared
  *
  * The log blocks have this layout, and are one of
  * two types of blocks that get overwritten in place:
@@ -197,6 +262,8 @@ extern char Enempty[];
  *		off[8] len[8]
  *	Alloc1, Free1:
  *		off[8]
+ *	Unit:
+ *		unit[8]
  *	Ref:
  *		off[8]
  *	Flush:	
@@ -205,20 +272,33 @@ extern char Enempty[];
  * Pivots have the following layout:
  *
  *	nval[2]
- *	valsz[2]
  *	nbuf[2]
- *	bufsz[2]
+ *	vals[nval]
+ *	msgs[nbuf]
  *
  * Leaves have the following layout:
  *
  *	nval[2]
- *	valsz[2]
- *	pad[4]sure, 
+ *	vals[nval]
+ *
+ * Keys are prefix compressed against the key
+ * before them, so values and messages are packed
+ * as:
+ *
+ *	val:	shared[1] nk[2] key[nk] nv[2] v[nv]
+ *	msg:	op[1] shared[1] nk[2] key[nk] nv[2] v[nv]
  *
  * Within these nodes, pointers have the following
  * layout:
  *
  *	off[8] hash[8] fill[2]
+ *
+ * Nodes that compress small enough are moved into
+ * a fragment when they're written, and stored as:
+ *
+ *	type[2] (Tlz)
+ *	clen[2]
+ *	lz[clen]	the packed pivot or leaf
  */
 enum {
 	Traw,
@@ -227,6 +307,7 @@ enum {
 	Tlog,
 	Tdead,
 	Tmagic,
+	Tlz,
 	Tarena = 0x6765,	/* 'ge' bigendian */
 };
 
@@ -235,10 +316,23 @@ enum {
 	Vref,	/* Block pointer */
 };
 
+/* block checksums */
+enum {
+	Hsip,
+	Hxx,
+};
+
+/* data block codecs */
+enum {
+	Znone,
+	Zlz,
+};
+
 enum {
 	GBraw	= 1<<0,
 	GBwrite	= 1<<1,
 	GBnochk	= 1<<2,
+	GBnosum	= 1<<3,	/* from an Xnosum extent */
 };
 
 enum {
@@ -280,6 +374,7 @@ enum {
 	LogFree1,	/* free a block */
 	LogChain,	/* point to next log block */
 	LogEnd,		/* last entry in log */	
+	LogUnit,	/* arena unit from here on */
 
 	/* 2-wide entries */
 #define	Log2wide	LogAlloc
@@ -301,6 +396,8 @@ enum {
 	AOnone,
 	AOsnap,
 	AOsync,
+	AOcompact,
+	AOnosum,
 };
 
 struct Bptr {
@@ -309,6 +406,24 @@ struct Bptr {
 	vlong	gen;
 };
 
+/*
+ * A run of data blocks laid out back to back
+ * on disk, and mapped by a single Kdat key. An
+ * extent with more than one block starts at an
+ * offset aligned to Extmax blocks, and no other
+ * key falls inside it. All blocks share a gen.
+ * A compressed block is always alone in its
+ * extent.
+ */
+struct Ext {
+	vlong	off;	/* file offset of the first block */
+	int	nblk;
+	int	codec;	/* Znone, or how bp[0] was compressed */
+	int	clen;	/* compressed length */
+	int	flag;	/* Xnosum */
+	Bptr	bp[Extmax];
+};
+
 struct Key{
 	char	*k;
 	int	nk;
@@ -357,6 +472,11 @@ struct Amsg {
 		struct {	/* AOsync */
 			int	halt;
 		};
+		struct {	/* AOcompact, AOnosum */
+			char	label[128];
+			int	budget;
+			int	nosum;
+		};
 	};
 };
 
@@ -379,10 +499,11 @@ struct Tree {
 	int	ht;
 	Bptr	bp;
 	vlong	gen;
+	int	flag;
 	Msg	flush[16];
 	int	nflush;
 	int	flushsz;
-	char	flushbuf[Bufspc/2];
+	char	flushbuf[Blksz/2];
 	Dlist	dead[Ndead];
 };
 
@@ -404,19 +525,40 @@ struct Syncq {
 	QLock	lk;
 	Rendez	fullrz;
 	Rendez	emptyrz;
+	Rendez	idlerz;
 	Blk	**heap;
 	int	nheap;
 	int	heapsz;
+	long	inflight[2];	/* popped, unwritten, by generation */
+
+	/* stats */
+	int	maxheap;
+	vlong	nwrite;	/* pwrites done */
+	vlong	wblk;	/* blocks they carried */
+	vlong	wbytes;	/* bytes they carried */
+	vlong	wtime;	/* nanoseconds spent in them */
 };
 
 struct Stats {
 	vlong	cachehit;
 	vlong	cachelook;
+
+	/* committed syncs */
+	vlong	nsync;
+	vlong	syncblk;
+	vlong	syncbytes;
+	vlong	syncns;
+	vlong	lastblk;
+	vlong	lastbytes;
+	vlong	lastns;
+	vlong	maxns;
 };
 
 struct Fshdr {
 	int	blksz;
 	int	bufspc;
+	int	hash;	/* block checksum: Hsip or Hxx */
+	int	dedup;	/* share identical data blocks */
 	Tree	snap;
 	int	narena;
 	vlong	arenasz;
@@ -430,15 +572,36 @@ struct Fshdr {
  */
 struct Gefs {
 	Fshdr;
+	/* pivot layout, see setbufspc */
+	int	pivspc;		/* packed value space */
+	int	nodepivspc;	/* unpacked value space */
+	int	nodebufspc;	/* unpacked buffer space */
 	/* arena allocation */
 	Arena	*arenas;
 	long	roundrobin;
 	long	syncing;
 	long	nsyncers;
+	int	syncdepth;	/* procs per sync queue */
 
 	int	gotinfo;
 	QLock	synclk;
 	Rendez	syncrz;
+	vlong	syncstart;	/* when the sync in flight began */
+	vlong	syncblk;	/* blocks it carries */
+	vlong	syncbytes;	/* and their bytes */
+
+	/* when to sync: tunable from the console */
+	long	syncpoll;
+	long	syncage;
+	vlong	syncdirty;
+	int	synccache;
+
+	/* queued since the last sync */
+	QLock	dirtylk;
+	Rendez	dirtyrz;
+	vlong	dirtyblk;
+	vlong	dirtybytes;
+	long	syncpending;	/* AOsync sent, not yet run */
 
 	QLock	snaplk;	/* snapshot lock */
 	Tree	*opensnap;
@@ -454,6 +617,7 @@ struct Gefs {
 	int	nworker;
 	Lock	freelk;
 	vlong	qgen;
+	vlong	syncgen;
 	long	epoch;
 	long	lepoch[32];
 	Bfree	*limbo[3];
@@ -466,6 +630,9 @@ struct Gefs {
 	long	rdonly;
 	int	noauth;
 	int	noperm;
+	int	lz;	/* compress file data */
+	int	lzmeta;	/* compress tree nodes */
+	int	elevator;	/* sync in address order */
 
 	/* user list */
 	RWLock	userlk;
@@ -478,6 +645,8 @@ struct Gefs {
 
 	/* slow block io */
 	QLock	blklk[32];
+	Rendez	blkrz[32];	/* for reads in flight */
+	Fetch	*fetching[32];
 
 	/* protected by lrulk */
 	QLock	lrulk;
@@ -495,6 +664,15 @@ struct Gefs {
 	Stats	stats;
 };
 
+/*
+ * A block getblk is reading in, without
+ * holding its blklk.
+ */
+struct Fetch {
+	vlong	addr;
+	Fetch	*next;
+};
+
 struct Arena {
 	Lock;
 	Avltree *free;
@@ -506,10 +684,15 @@ struct Arena {
 	vlong	size;
 	vlong	used;
 	vlong	reserve;
+	int	unit;	/* allocation size: Fragsz, Blksz or fs->blksz */
+	int	nlog;	/* log blocks, Blksz each */
 	/* freelist */
 	Bptr	head;
 	Blk	*tail;	/* tail held open for writing */
 	Syncq	*sync;
+	/* tail and header saved for the sync in flight */
+	char	*cmt;
+	vlong	cmttail;
 };
 
 struct Xdir {
@@ -542,6 +725,10 @@ struct Mount {
 	vlong	gen;
 	char	*name;
 	Tree	*root;
+
+	/* where the next compaction pass resumes */
+	char	cpbuf[Keymax];
+	int	ncp;
 };
 
 struct Conn {
@@ -619,14 +806,20 @@ struct Blk {
 	Blk	*fnext;
 
 	long	flag;
-	long	qgen;
+	vlong	qgen;	/* sync generation */
+	vlong	qseq;	/* order it was queued in */
 
 	/* serialized to disk in header */
 	short	type;	/* @0, for all */
-	short	nval;	/* @2, for Leaf, Pivot: data[0:2] */
-	short	valsz;	/* @4, for Leaf, Pivot: data[2:4] */
-	short   nbuf;	/* @6, for Pivot */
-	short   bufsz;	/* @8, for Pivot */
+	short	nval;	/* @2, for Leaf, Pivot */
+	short   nbuf;	/* @4, for Pivot */
+
+	/* unpacked node sizes */
+	short	valsz;
+	short   bufsz;
+	/* packed node sizes */
+	short	pvalsz;
+	short	pbufsz;
 
 	vlong	logsz;	/* for allocation log */
 	vlong	lognxt;	/* for allocation log */
@@ -648,6 +841,20 @@ struct Blk {
 	Bptr	bp;
 	long	ref;
 	char	*data;
+	char	*node;	/* unpacked node, Nodesz bytes */
+	char	*raw;	/* file data, when fs->blksz > Blksz */
+	char	*zbuf;	/* compressed file data, as on disk */
+	int	clen;	/* compressed length, 0 if stored raw */
+	RWLock	datlk;	/* file data, against in-place writes */
+
+	/* search index for nodes, see mkindex */
+	short	ixnval;
+	short	ixnbuf;
+	short	ixvpfx;
+	short	ixbpfx;
+	u32int	*ixval;
+	u32int	*ixbuf;
+	uchar	*bloom;	/* keys in the buffer, for Pivot */
 	char	buf[Blksz];
 	vlong	magic;
 };
@@ -22,7 +22,7 @@ showkey(Fmt *fmt, Key *k)
 	if(k->nk == 0)
 		return fmtprint(fmt, "\"\"");
 	switch(k->k[0]){
-	case Kdat:	/* qid[8] off[8] => ptr[16]:	pointer to data page */
+	case Kdat:	/* qid[8] off[8] => ptr[24] hash[8]*:	extent of data pages */
 		n = fmtprint(fmt, "dat qid:%llx off:%llx", UNPACK64(k->k+1), UNPACK64(k->k+9));
 		break;
 	case Kent:	/* pqid[8] name[n] => dir[n]:	serialized Dir */
@@ -37,6 +37,15 @@ showkey(Fmt *fmt, Key *k)
 	case Ksuper:	/* qid[8] => pqid[8]:		parent dir */
 		n = fmtprint(fmt, "up dir:%llx", UNPACK64(k->k+1));
 		break;
+	case Kinl:	/* qid[8] => data[n]:		contents of a small file */
+		n = fmtprint(fmt, "inl qid:%llx", UNPACK64(k->k+1));
+		break;
+	case Kdedup:	/* hash[8] => ptr[24]:		data block with this hash */
+		n = fmtprint(fmt, "dedup hash:%.16llux", UNPACK64(k->k+1));
+		break;
+	case Kdref:	/* addr[8] => ref[8]:		extra refs to a shared block */
+		n = fmtprint(fmt, "dref addr:%llx", UNPACK64(k->k+1));
+		break;
 	default:
 		n = fmtprint(fmt, "%.*H", k->nk, k->k);
 		break;
@@ -47,8 +56,9 @@ showkey(Fmt *fmt, Key *k)
 static int
 showval(Fmt *fmt, Kvp *v, int op, int flg)
 {
-	int n, ws;
+	int n, ws, fl;
 	char *p;
+	Bptr bp;
 	Tree t;
 	Xdir d;
 
@@ -63,7 +73,7 @@ showval(Fmt *fmt, Kvp *v, int op, int flg)
 		return n;
 	}
 	switch(v->k[0]){
-	case Kdat:	/* qid[8] off[8] => ptr[16]:	pointer to data page */
+	case Kdat:	/* qid[8] off[8] => ptr[24] hash[8]*:	extent of data pages */
 		switch(op){
 		case Odelete:
 		case Oclearb:
@@ -71,7 +81,16 @@ showval(Fmt *fmt, Kvp *v, int op, int flg)
 			break;
 		case Onop:
 		case Oinsert:
-			n = fmtprint(fmt, "ptr:%B", unpackbp(v->v, v->nv));
+			bp = unpackbp(v->v, v->nv);
+			fl = bp.addr & Xflags;
+			bp.addr &= ~Xflags;
+			n = fmtprint(fmt, "ptr:%B", bp);
+			if(fl & Xnosum)
+				n += fmtprint(fmt, " nosum");
+			if(v->nv == Zextsz)
+				n += fmtprint(fmt, " z%d:%d", v->v[Ptrsz], UNPACK32(v->v+Ptrsz+1));
+			else if(v->nv > Ptrsz)
+				n += fmtprint(fmt, "+%d", (v->nv - Ptrsz)/8);
 			break;
 		}
 		break;
@@ -130,7 +149,7 @@ showval(Fmt *fmt, Kvp *v, int op, int flg)
 	case Ksnap:	/* name[n] => dent[16] ptr[16]:	snapshot root */
 		if(unpacktree(&t, v->v, v->nv) == nil)
 			return fmtprint(fmt, "corrupt tree");
-		n = fmtprint(fmt, "ref: %d, ht: %d, bp: %B, prev=%lld", t.ref, t.ht, t.bp, t.dead[0].prev);
+		n = fmtprint(fmt, "ref: %d, ht: %d, bp: %B, prev=%lld, flag=%x", t.ref, t.ht, t.bp, t.dead[0].prev, t.flag);
 		break;
 	case Klabel:
 		n = fmtprint(fmt, "snap id:\"%llx\"", UNPACK64(v->v+1));
@@ -138,6 +157,15 @@ showval(Fmt *fmt, Kvp *v, int op, int flg)
 	case Ksuper:	/* qid[8] => pqid[8]:		parent dir */
 		n = fmtprint(fmt, "super dir:%llx, name:\"%.*s\")", UNPACK64(v->v+1), v->nv-11, v->v+11);
 		break;
+	case Kinl:	/* qid[8] => data[n]:		contents of a small file */
+		n = fmtprint(fmt, "data:%d bytes", v->nv);
+		break;
+	case Kdedup:	/* hash[8] => ptr[24]:		data block with this hash */
+		n = fmtprint(fmt, "ptr:%B", unpackbp(v->v, v->nv));
+		break;
+	case Kdref:	/* addr[8] => ref[8]:		extra refs to a shared block */
+		n = fmtprint(fmt, "ref:%lld", UNPACK64(v->v));
+		break;
 	default:
 		n = fmtprint(fmt, "%.*H", v->nk, v->k);
 		break;
@@ -331,6 +359,83 @@ showtree(int fd, char **ap, int na)
 		closesnap(t);
 }
 
+static void
+rshowshape(Blk *b, int lvl, vlong *nblk, vlong *vfill, vlong *bfill)
+{
+	Blk *c;
+	Kvp kv;
+	int i;
+
+	nblk[lvl]++;
+	vfill[lvl] += b->pvalsz;
+	bfill[lvl] += b->pbufsz;
+	if(b->type != Tpivot)
+		return;
+	for(i = 0; i < b->nval; i++){
+		getval(b, i, &kv);
+		if((c = getblk(getptr(&kv, nil), 0)) == nil)
+			sysfatal("failed load: %r");
+		rshowshape(c, lvl+1, nblk, vfill, bfill);
+		dropblk(c);
+	}
+}
+
+/*
+ * Summarizes how full the nodes at each level
+ * of a tree are.
+ */
+void
+showshape(int fd, char **ap, int na)
+{
+	vlong *nblk, *vfill, *bfill;
+	char *name;
+	Tree *t;
+	Blk *b;
+	int i, h;
+
+	name = "main";
+	if(na == 1)
+		name = ap[0];
+	if(strcmp(name, "snap") == 0)
+		t = &fs->snap;
+	else if((t = openlabel(name)) == nil){
+		fprint(fd, "open %s: %r\n", name);
+		return;
+	}
+	if((b = getroot(t, &h)) == nil){
+		fprint(fd, "load root: %r\n");
+		goto Out;
+	}
+	nblk = calloc(h, sizeof(vlong));
+	vfill = calloc(h, sizeof(vlong));
+	bfill = calloc(h, sizeof(vlong));
+	if(nblk == nil || vfill == nil || bfill == nil){
+		fprint(fd, "alloc shape: %r\n");
+		goto Free;
+	}
+	rshowshape(b, 0, nblk, vfill, bfill);
+	fprint(fd, "=== [%s] %B @%d\n", name, t->bp, h);
+	for(i = 0; i < h; i++){
+		if(nblk[i] == 0)
+			continue;
+		if(i == h-1)
+			fprint(fd, "\tlevel %d: %lld leaves, %.1f%% full\n", i, nblk[i],
+				100.0*vfill[i]/(nblk[i]*Pkleafspc));
+		else
+			fprint(fd, "\tlevel %d: %lld pivots, %.1f%% full, %.1f%% buffered\n", i, nblk[i],
+				100.0*vfill[i]/(nblk[i]*fs->pivspc),
+				100.0*bfill[i]/(nblk[i]*fs->bufspc));
+	}
+Free:
+	free(nblk);
+	free(vfill);
+	free(bfill);
+	dropblk(b);
+Out:
+	if(t != &fs->snap)
+		closesnap(t);
+}
+
 void
 showbp(int fd, Bptr bp, int recurse)
 {
@@ -357,6 +462,7 @@ showtreeroot(int fd, Tree *t)
 	fprint(fd, "\tref:\t%d\n", t->ref);
 	fprint(fd, "\tht:\t%d\n", t->ht);
 	fprint(fd, "\tbp:\t%B\n", t->bp);
+	fprint(fd, "\tflag:\t%x\n", t->flag);
 	for(i = 0; i < Ndead; i++){
 		dl = &t->dead[i];
 		fprint(fd, "	deadlist[%d]:\n", i);
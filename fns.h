@@ -27,9 +27,14 @@ extern char*	forceuser;
 			   (p)[4]=(v)>>24;(p)[5]=(v)>>16;(p)[6]=(v)>>8;(p)[7]=(v);}while(0)
 
 Blk*	newblk(int type);
+Blk*	newblkat(int type, vlong);
+Blk*	newdatblk(vlong);
+int	rawsz(vlong);
 Blk*	dupblk(Blk*);
 Blk*	getroot(Tree*, int*);
 Blk*	getblk(Bptr, int);
+Blk*	getextblk(Ext*, int);
+void	setlz(Blk*, char*, int);
 Blk*	holdblk(Blk*);
 void	dropblk(Blk*);
 
@@ -54,6 +59,9 @@ void	freeblk(Tree*, Blk*);
 void	freebp(Tree*, Bptr);
 int	killblk(Tree*, Bptr);
 void	reclaimblk(Bptr);
+int	canreuse(Tree*, Blk*);
+int	blkinuse(vlong);
+int	blkmatch(vlong, Blk*);
 ushort	blkfill(Blk*);
 uvlong	blkhash(Blk*);
 u32int	ihash(uvlong);
@@ -64,19 +72,37 @@ char*	labelsnap(char*, vlong);
 char*	unlabelsnap(vlong, char*);
 char*	refsnap(vlong);
 char*	unrefsnap(vlong, vlong);
+int	dedupblk(Blk*, Bptr*);
+int	dedupshared(vlong);
+int	dedupfree(Bptr);
+void	dedupdrop(Bptr);
 Tree*	openlabel(char*);
 Tree*	opensnap(vlong);
 void	closesnap(Tree*);
 uvlong	siphash(void*, usize);
-void	reamfs(char*);
+uvlong	xxhash(void*, usize);
+uvlong	bufhash(void*, usize);
+void	benchhash(int, int);
+int	lzenc(char*, int, char*, int);
+int	lzdec(char*, int, char*, int);
+void	reamfs(char*, int);
+char*	setbufspc(Gefs*, int);
+char*	setblksz(Gefs*, int);
+char*	sethash(Gefs*, char*);
+int	devblksz(char*);
 int	loadarena(Arena*, Fshdr *fi, vlong);
 void	loadfs(char*);
 void	sync(void);
+void	syncwait(void);
 int	loadlog(Arena*);
 int	scandead(Dlist*, int, void(*)(Bptr, void*), void*);
 int	endfs(void);
 int	compresslog(Arena*);
 void	setval(Blk*, Kvp*);
+void	packnode(Blk*);
+int	unpacknode(Blk*);
+void	mkindex(Blk*);
+void	benchkeycmp(int, int);
 
 Conn*	newconn(int, int);
 
@@ -86,6 +112,8 @@ User*	name2user(char*);
 
 char*	btupsert(Tree*, Msg*, int);
 char*	btlookup(Tree*, Key*, Kvp*, char*, int);
+char*	btlookupext(Tree*, vlong, vlong, Ext*);
+char*	btcompact(Tree*, Key*, int*);
 char*	btscan(Tree*, Scan*, char*, int);
 char*	btnext(Scan*, Kvp*, int*);
 void	btdone(Scan*);
@@ -110,6 +138,7 @@ void	showblk(int, Blk*, char*, int);
 void	showbp(int, Bptr, int);
 void	showtreeroot(int, Tree*);
 void	showtree(int, char**, int);
+void	showshape(int, char**, int);
 void	showsnap(int, char**, int);
 void	showfid(int, char**, int);
 void	showcache(int, char**, int);
@@ -141,6 +170,8 @@ int	kv2qid(Kvp*, Qid*);
 
 char*	packbp(char*, int, Bptr*);
 Bptr	unpackbp(char*, int);
+char*	packext(char*, int, Ext*);
+Ext*	unpackext(Ext*, char*, int);
 char*	packtree(char*, int, Tree*);
 Tree*	unpacktree(Tree*, char*, int);
 char*	packdkey(char*, int, vlong, char*);
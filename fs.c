@@ -79,6 +79,7 @@ snapfs(int fd, char *old, char *new)
 	closesnap(t);
 	/* we probably want explicit snapshots to get synced */
 	sync();
+	syncwait();
 	if(new != nil)
 		fprint(fd, "snap taken: %s\n", new);
 	else
@@ -255,55 +256,213 @@ lookup(Mount *mnt, Key *k, Kvp *kv, char *buf, int nbuf)
 
 /*
  * Clears all blocks in that intersect with
- * the range listed.
+ * the range listed. Holes, and all but the
+ * first block of an extent, have no key, and
+ * clearing a key that isn't there breaks
+ * lookups, so this clears the keys a scan
+ * turns up. The range must start at an
+ * extent.
  */
 static char*
 clearb(Fid *f, vlong o, vlong sz)
 {
-	char *e, buf[Offksz];
+	char *e, buf[Offksz], pfx[1+8], kvbuf[1+8+Inlmax];
+	vlong v, *off, *noff;
+	int i, n, na, done;
+	Scan *s;
+	Kvp kv;
+	Key k;
 	Msg m;
 
-	o &= ~(Blksz - 1);
-	for(; o < sz; o += Blksz){
+	/* small files may still keep their data in blocks */
+	if(o == 0 && sz > 0 && sz <= Inlmax){
+		k.k = buf;
+		k.nk = 1+8;
+		k.k[0] = Kinl;
+		PACK64(k.k+1, f->qpath);
+		e = lookup(f->mnt, &k, &kv, kvbuf, sizeof(kvbuf));
+		if(e == nil){
+			m.op = Oclearb;
+			m.k = buf;
+			m.nk = 1+8;
+			m.v = nil;
+			m.nv = 0;
+			if((e = btupsert(f->mnt->root, &m, 1)) != nil)
+				return e;
+		}else if(e != Eexist)
+			return e;
+	}
+	o &= ~(fs->blksz - 1);
+	if((s = mallocz(sizeof(Scan), 1)) == nil)
+		return Enomem;
+	/* the tree can't change under a scan, so gather first */
+	n = 0;
+	na = 0;
+	off = nil;
+	pfx[0] = Kdat;
+	PACK64(pfx+1, f->qpath);
+	if((e = btscan(f->mnt->root, s, pfx, sizeof(pfx))) != nil)
+		goto Out;
+	while(1){
+		if((e = btnext(s, &s->kv, &done)) != nil)
+			goto Out;
+		if(done)
+			break;
+		v = UNPACK64(s->kv.k+9);
+		if(v < o || v >= sz)
+			continue;
+		if(n == na){
+			na = (na == 0) ? 16 : 2*na;
+			if((noff = realloc(off, na*sizeof(vlong))) == nil){
+				e = Enomem;
+				goto Out;
+			}
+			off = noff;
+		}
+		off[n++] = v;
+	}
+	btdone(s);
+	for(i = 0; i < n; i++){
 		m.k = buf;
 		m.nk = sizeof(buf);
 		m.op = Oclearb;
 		m.k[0] = Kdat;
 		PACK64(m.k+1, f->qpath);
-		PACK64(m.k+9, o);
+		PACK64(m.k+9, off[i]);
 		m.v = nil;
 		m.nv = 0;
 		if((e = btupsert(f->mnt->root, &m, 1)) != nil)
-			return e;
+			break;
 	}
+	free(off);
+	free(s);
+	return e;
+Out:
+	btdone(s);
+	free(off);
+	free(s);
+	return e;
+}
+
+static char*
+lookupext(Mount *mnt, vlong qpath, vlong off, Ext *x)
+{
+	char *e;
+	Tree *r;
+
+	if(mnt == nil)
+		return Eattach;
+
+	lock(mnt);
+	r = mnt->root;
+	ainc(&r->memref);
+	unlock(mnt);
+
+	e = btlookupext(r, qpath, off, x);
+	closesnap(r);
+	return e;
+}
+
+/*
+ * Files of up to Inlmax bytes keep their
+ * contents in the tree, rather than paying
+ * for a whole data block. Files written
+ * before that may still use blocks, so
+ * Eexist sends callers to the blocks.
+ */
+static char*
+readinl(Fid *f, char *d, vlong o, vlong n, vlong sz)
+{
+	char *e, buf[1+8], kvbuf[1+8+Inlmax];
+	Key k;
+	Kvp kv;
+
+	if(sz == 0)
+		return Eexist;
+	k.k = buf;
+	k.nk = sizeof(buf);
+	k.k[0] = Kinl;
+	PACK64(k.k+1, f->qpath);
+	if((e = lookup(f->mnt, &k, &kv, kvbuf, sizeof(kvbuf))) != nil)
+		return e;
+	if(kv.nv > sz)
+		kv.nv = sz;
+	memset(d, 0, n);
+	if(o < kv.nv)
+		memcpy(d, kv.v+o, (o+n < kv.nv) ? n : kv.nv-o);
 	return nil;
 }
 
+static char*
+writeinl(Fid *f, char *s, vlong o, vlong n, vlong sz)
+{
+	char *e, buf[1+8], vbuf[Inlmax];
+	vlong end;
+	Msg m;
+
+	end = (o+n > sz) ? o+n : sz;
+	assert(end <= Inlmax);
+	if((e = readinl(f, vbuf, 0, end, sz)) != nil){
+		if(e != Eexist || sz != 0)
+			return e;
+		memset(vbuf, 0, end);
+	}
+	memcpy(vbuf+o, s, n);
+	m.op = Oinsert;
+	m.k = buf;
+	m.nk = sizeof(buf);
+	m.k[0] = Kinl;
+	PACK64(m.k+1, f->qpath);
+	m.v = vbuf;
+	m.nv = end;
+	return btupsert(f->mnt->root, &m, 1);
+}
+
+static int	writeb(Fid*, char*, vlong, vlong, vlong);
+
+/*
+ * Moves the contents of a file that outgrew
+ * Inlmax out to data blocks.
+ */
+static char*
+uninline(Fid *f, vlong sz)
+{
+	char *e, buf[1+8], vbuf[Inlmax];
+	vlong o, n;
+	Msg m;
+
+	if((e = readinl(f, vbuf, 0, sz, sz)) != nil)
+		return (e == Eexist) ? nil : e;
+	for(o = 0; o < sz; o += n)
+		if((n = writeb(f, vbuf+o, o, sz-o, 0)) == -1)
+			return Efs;
+	m.op = Odelete;
+	m.k = buf;
+	m.nk = sizeof(buf);
+	m.k[0] = Kinl;
+	PACK64(m.k+1, f->qpath);
+	m.v = nil;
+	m.nv = 0;
+	return btupsert(f->mnt->root, &m, 1);
+}
+
 static int
 readb(Fid *f, char *d, vlong o, vlong n, vlong sz)
 {
-	char *e, buf[17], kvbuf[17+32];
 	vlong fb, fo;
-	Bptr bp;
+	char *e;
 	Blk *b;
-	Key k;
-	Kvp kv;
+	Ext x;
 
 	if(o >= sz)
 		return 0;
 
-	fb = o & ~(Blksz-1);
-	fo = o & (Blksz-1);
-	if(fo+n > Blksz)
-		n = Blksz-fo;
+	fb = o & ~(fs->blksz-1);
+	fo = o & (fs->blksz-1);
+	if(fo+n > fs->blksz)
+		n = fs->blksz-fo;
 
-	k.k = buf;
-	k.nk = sizeof(buf);
-	k.k[0] = Kdat;
-	PACK64(k.k+1, f->qpath);
-	PACK64(k.k+9, fb);
-
-	e = lookup(f->mnt, &k, &kv, kvbuf, sizeof(kvbuf));
+	e = lookupext(f->mnt, f->qpath, fb, &x);
 	if(e != nil){
 		if(e != Eexist){
 			werrstr(e);
@@ -313,63 +472,303 @@ readb(Fid *f, char *d, vlong o, vlong n, vlong sz)
 		return n;
 	}
 
-	bp = unpackbp(kv.v, kv.nv);
-	if((b = getblk(bp, GBraw)) == nil)
+	if((b = getextblk(&x, (fb - x.off)/fs->blksz)) == nil)
 		return -1;
-	memcpy(d, b->buf+fo, n);
+	rlock(&b->datlk);
+	memcpy(d, b->data+fo, n);
+	runlock(&b->datlk);
 	dropblk(b);
 	return n;
 }
 
-static int
-writeb(Fid *f, Msg *m, Bptr *ret, char *s, vlong o, vlong n, vlong sz)
+/*
+ * Tries to put the block at fb right after
+ * the block before it on disk, growing the
+ * extent that ends there.
+ */
+static Blk*
+extendb(Fid *f, vlong fb, Ext *x)
 {
-	char *e, buf[Kvmax];
-	vlong fb, fo;
-	Blk *b, *t;
-	Bptr bp;
-	Kvp kv;
+	Bptr *last;
+	Blk *b;
 
-	fb = o & ~(Blksz-1);
-	fo = o & (Blksz-1);
+	if(fb % (Extmax*fs->blksz) == 0)
+		return nil;
+	if(lookupext(f->mnt, f->qpath, fb - fs->blksz, x) != nil)
+		return nil;
+	if(x->off % (Extmax*fs->blksz) != 0 || x->codec != Znone)
+		return nil;
+	/* the whole extent is checked, or none of it */
+	if(!(x->flag & Xnosum) != !(f->mnt->root->flag & TFnosum))
+		return nil;
+	if(x->off + x->nblk*fs->blksz != fb)
+		return nil;
+	last = &x->bp[x->nblk-1];
+	if(last->gen != fs->nextgen || rawsz(last->addr) != fs->blksz)
+		return nil;
+	if((b = newblkat(Traw, last->addr + fs->blksz)) == nil)
+		return nil;
+	x->nblk++;
+	return b;
+}
+
+static void
+extmsg(Msg *m, char *kbuf, char *vbuf, vlong qpath, Ext *x)
+{
+	char *p;
 
+	m->op = Oinsert;
+	m->k = kbuf;
+	m->nk = Offksz;
 	m->k[0] = Kdat;
-	PACK64(m->k+1, f->qpath);
-	PACK64(m->k+9, fb);
+	PACK64(m->k+1, qpath);
+	PACK64(m->k+9, x->off);
+	p = packext(vbuf, Extsz, x);
+	m->v = vbuf;
+	m->nv = p - vbuf;
+}
 
+/*
+ * Checks a buffer for zeros, a word
+ * at a time once it's aligned.
+ */
+static int
+iszero(char *p, vlong n)
+{
+	uvlong *w;
+
+	for(; n > 0 && ((uintptr)p & 7) != 0; n--)
+		if(*p++ != 0)
+			return 0;
+	for(w = (uvlong*)p; n >= 32; n -= 32, w += 4)
+		if((w[0]|w[1]|w[2]|w[3]) != 0)
+			return 0;
+	for(p = (char*)w; n > 0; n--)
+		if(*p++ != 0)
+			return 0;
+	return 1;
+}
+
+/*
+ * Builds the new contents of the block in
+ * memory, and stores them compressed if that
+ * lets them fit in a smaller unit. Returns
+ * nil if it doesn't pay off.
+ */
+static Blk*
+lzblk(Blk *t, char *s, vlong fo, vlong n, vlong need)
+{
+	static char *buf, *zbuf;
+	int room, clen;
+	Blk *b;
+
+	if(need > Blksz && Blksz < fs->blksz)
+		room = Blksz;
+	else if(need > Fragsz)
+		room = Fragsz;
+	else
+		return nil;
+	/* only the mutator writes, so these can be shared */
+	if(buf == nil){
+		if((buf = malloc(2*fs->blksz)) == nil)
+			return nil;
+		zbuf = buf + fs->blksz;
+	}
+	if(t != nil)
+		memcpy(buf, t->data, need);
+	else
+		memset(buf, 0, need);
+	memcpy(buf+fo, s, n);
+	memset(buf+need, 0, fs->blksz-need);
+	if((clen = lzenc(zbuf, room, buf, need)) == -1)
+		return nil;
+	if((b = newdatblk(clen)) == nil)
+		return nil;
+	memcpy(b->data, buf, fs->blksz);
+	setlz(b, zbuf, clen);
+	return b;
+}
+
+/*
+ * Writes the block holding o, and points
+ * the tree at it. When the old block was
+ * copied out of an extent, the extent gets
+ * split around it. Blocks that end up all
+ * zero are left as holes instead.
+ */
+static int
+writeb(Fid *f, char *s, vlong o, vlong n, vlong sz)
+{
+	char *e, kbuf[Extmax+1][Offksz], vbuf[Extmax+1][Extsz];
+	vlong fb, fo, need;
+	int i, j, u, nm, inext, inplace, shared;
+	Msg mb[Extmax+1];
+	Blk *b, *t;
+	Bptr sbp;
+	Ext x, y;
+
+	fb = o & ~(fs->blksz-1);
+	fo = o & (fs->blksz-1);
+	/* the last block of the file only needs to hold the tail */
+	need = ((o+n > sz) ? o+n : sz) - fb;
+	if(need > fs->blksz)
+		need = fs->blksz;
+	if(fo+n > fs->blksz)
+		n = fs->blksz-fo;
 
-	b = newblk(Traw);
-	if(b == nil)
-		return -1;
 	t = nil;
-	if(fb < sz && (fo != 0 || n != Blksz)){
-		e = lookup(f->mnt, m, &kv, buf, sizeof(buf));
+	i = -1;
+	if(fb < sz){
+		e = lookupext(f->mnt, f->qpath, fb, &x);
 		if(e == nil){
-			bp = unpackbp(kv.v, kv.nv);
-			if((t = getblk(bp, GBraw)) == nil)
+			i = (fb - x.off)/fs->blksz;
+			if((t = getextblk(&x, i)) == nil)
 				return -1;
-			memcpy(b->buf, t->buf, Blksz);
-			freeblk(f->mnt->root, t);
-			dropblk(t);
 		}else if(e != Eexist){
 			werrstr("%s", e);
 			return -1;
 		}
 	}
-	if(fo+n > Blksz)
-		n = Blksz-fo;
-	memcpy(b->buf+fo, s, n);
-	if(t == nil){
-		if(fo > 0)
-			memset(b->buf, 0, fo);
-		if(fo+n < Blksz)
-			memset(b->buf+fo+n, 0, Blksz-fo-n);
+	inext = 0;
+	inplace = 0;
+	shared = 0;
+	if(iszero(s, n)){
+		/* a zero write into a hole stays a hole */
+		if(t == nil)
+			return n;
+		if(iszero(t->data, fo) && iszero(t->data+fo+n, fs->blksz-fo-n)){
+			freeblk(f->mnt->root, t);
+			dropblk(t);
+			b = nil;
+			goto Split;
+		}
+	}
+	if(fs->lz && (b = lzblk(t, s, fo, n, need)) != nil){
+		if(t != nil){
+			freeblk(f->mnt->root, t);
+			dropblk(t);
+		}
+		if(f->mnt->root->flag & TFnosum)
+			setflag(b, Bnosum);
+		enqueue(b);
+		goto Split;
+	}
+	if(t != nil && t->clen == 0 && rawsz(t->bp.addr) >= need
+	&& !(x.flag & Xnosum) == !(f->mnt->root->flag & TFnosum)
+	&& canreuse(f->mnt->root, t)){
+		/*
+		 * Nothing on disk refers to this block
+		 * yet, so we can skip the copy and
+		 * overwrite it in place.
+		 */
+		b = t;
+		if(fs->dedup)
+			dedupdrop(b->bp);
+		/* readers may have it from the cache */
+		wlock(&b->datlk);
+		inplace = 1;
+		setflag(b, Bdirty);
+		inext = 1;
+	}else{
+		b = nil;
+		if(t == nil && need == fs->blksz && (b = extendb(f, fb, &x)) != nil){
+			i = x.nblk-1;
+			inext = 1;
+		}
+		if(b == nil && (b = newdatblk(need)) == nil){
+			dropblk(t);
+			return -1;
+		}
+		if(t != nil){
+			if(fo != 0 || n != fs->blksz)
+				memcpy(b->data, t->data, fs->blksz);
+			freeblk(f->mnt->root, t);
+			dropblk(t);
+		}else{
+			if(fo > 0)
+				memset(b->data, 0, fo);
+			if(fo+n < fs->blksz)
+				memset(b->data+fo+n, 0, fs->blksz-fo-n);
+		}
+	}
+	memcpy(b->data+fo, s, n);
+	if((u = rawsz(b->bp.addr)) < fs->blksz)
+		memset(b->data+u, 0, fs->blksz-u);
+	if(f->mnt->root->flag & TFnosum)
+		setflag(b, Bnosum);
+	else
+		clrflag(b, Bnosum);
+	if(inplace)
+		wunlock(&b->datlk);
+	if(fs->dedup && !inext && !checkflag(b, Bnosum) && dedupblk(b, &sbp)){
+		/* b never made it to disk, so it goes right back */
+		clrflag(b, Bdirty);
+		freebp(f->mnt->root, b->bp);
+		b->bp.addr = -1;
+		dropblk(b);
+		b = nil;
+		shared = 1;
+	}else
+		enqueue(b);
+
+Split:
+	nm = 0;
+	if(inext){
+		x.bp[i] = b->bp;
+		extmsg(&mb[nm], kbuf[nm], vbuf[nm], f->qpath, &x);
+		nm++;
+	}else{
+		/* the blocks before fb keep the extent key */
+		if(i > 0){
+			y = x;
+			y.nblk = i;
+			extmsg(&mb[nm], kbuf[nm], vbuf[nm], f->qpath, &y);
+			nm++;
+		}
+		y.off = fb;
+		y.nblk = 1;
+		y.codec = Znone;
+		y.clen = 0;
+		y.flag = 0;
+		if(shared){
+			y.bp[0] = sbp;
+			extmsg(&mb[nm], kbuf[nm], vbuf[nm], f->qpath, &y);
+			nm++;
+		}else if(b != nil){
+			y.bp[0] = b->bp;
+			if(checkflag(b, Bnosum))
+				y.flag = Xnosum;
+			if(b->clen != 0){
+				y.codec = Zlz;
+				y.clen = b->clen;
+			}
+			extmsg(&mb[nm], kbuf[nm], vbuf[nm], f->qpath, &y);
+			nm++;
+		}else if(i == 0){
+			/*
+			 * punching the head of the extent:
+			 * Oclearb would free all of it.
+			 */
+			extmsg(&mb[nm], kbuf[nm], vbuf[nm], f->qpath, &y);
+			mb[nm].op = Odelete;
+			mb[nm].v = nil;
+			mb[nm].nv = 0;
+			nm++;
+		}
+		/* and the ones after it get keys of their own */
+		y.flag = x.flag;
+		for(j = i+1; i != -1 && j < x.nblk; j++){
+			y.off = x.off + j*fs->blksz;
+			y.bp[0] = x.bp[j];
+			extmsg(&mb[nm], kbuf[nm], vbuf[nm], f->qpath, &y);
+			nm++;
+		}
 	}
-	enqueue(b);
-
-	packbp(m->v, m->nv, &b->bp);
-	*ret = b->bp;
 	dropblk(b);
+	if((e = btupsert(f->mnt->root, mb, nm)) != nil){
+		werrstr("%s", e);
+		return -1;
+	}
 	return n;
 }
 
@@ -481,6 +880,73 @@ clunkmount(Mount *mnt)
 	unlock(&fs->mountlk);
 }
 
+/*
+ * Runs one pass of compaction over a mounted
+ * tree, picking up where the last pass ended.
+ */
+static void
+compactfs(int fd, char *name, int budget)
+{
+	Mount *mnt;
+	char *e;
+	Key k;
+	int n;
+
+	lock(&fs->mountlk);
+	for(mnt = fs->mounts; mnt != nil; mnt = mnt->next)
+		if(strcmp(name, mnt->name) == 0){
+			ainc(&mnt->ref);
+			break;
+		}
+	unlock(&fs->mountlk);
+	if(mnt == nil){
+		fprint(fd, "compact: %s not mounted\n", name);
+		return;
+	}
+	k.k = mnt->cpbuf;
+	k.nk = mnt->ncp;
+	n = budget;
+	if((e = btcompact(mnt->root, &k, &n)) != nil){
+		fprint(fd, "compact %s: %s\n", name, e);
+		goto Out;
+	}
+	mnt->ncp = k.nk;
+	fprint(fd, "compact %s: rewrote %d nodes, %s\n", name, budget - n,
+		(k.nk == 0) ? "done" : "more to go");
+Out:
+	clunkmount(mnt);
+}
+
+static void
+nosumfs(int fd, char *name, int on)
+{
+	Mount *mnt;
+	Tree *t;
+
+	lock(&fs->mountlk);
+	for(mnt = fs->mounts; mnt != nil; mnt = mnt->next)
+		if(strcmp(name, mnt->name) == 0){
+			ainc(&mnt->ref);
+			break;
+		}
+	unlock(&fs->mountlk);
+	if(mnt == nil){
+		fprint(fd, "nosum: %s not mounted\n", name);
+		return;
+	}
+	/* the flag is saved with the tree on the next sync */
+	t = mnt->root;
+	lock(&t->lk);
+	if(on)
+		t->flag |= TFnosum;
+	else
+		t->flag &= ~TFnosum;
+	t->dirty = 1;
+	unlock(&t->lk);
+	fprint(fd, "nosum %s: %s\n", name, on ? "on" : "off");
+	clunkmount(mnt);
+}
+
 static void
 clunkdent(Dent *de)
 {
@@ -1264,6 +1730,13 @@ fswstat(Fmsg *m)
 			rerror(m, Eperm);
 			goto Out;
 		}
+		e = nil;
+		if(de->length <= Inlmax && n.length > Inlmax)
+			e = uninline(f, de->length);
+		if(e != nil){
+			rerror(m, e);
+			goto Out;
+		}
 	}
 	if(op & (Owmode|Owmtime)){
 		if(!fs->noperm && f->uid != de->uid && !groupleader(f->uid, de->gid)){
@@ -1614,6 +2087,7 @@ fsopen(Fmsg *m)
 		wlock(f->dent);
 		f->dent->muid = f->uid;
 		f->dent->qid.vers++;
+		clearb(f, 0, f->dent->length);
 		f->dent->length = 0;
 
 		mb.op = Owstat;
@@ -1625,7 +2099,6 @@ fsopen(Fmsg *m)
 		mb.nk = f->dent->nk;
 		mb.v = buf;
 		mb.nv = p - buf;
-		clearb(f, 0, f->dent->length);
 		if((e = btupsert(f->mnt->root, &mb, 1)) != nil){
 			wunlock(f->dent);
 			rerror(m, e);
@@ -1808,7 +2281,7 @@ static char*
 readfile(Fmsg *m, Fid *f, Fcall *r)
 {
 	vlong n, c, o;
-	char *p;
+	char *p, *err;
 	Dent *e;
 
 	e = f->dent;
@@ -1822,6 +2295,18 @@ readfile(Fmsg *m, Fid *f, Fcall *r)
 	o = m->offset;
 	if(m->offset + m->count > e->length)
 		c = e->length - m->offset;
+	if(e->length <= Inlmax){
+		err = readinl(f, p, o, c, e->length);
+		if(err == nil){
+			r->count = c;
+			runlock(e);
+			return nil;
+		}
+		if(err != Eexist){
+			runlock(e);
+			return err;
+		}
+	}
 	while(c != 0){
 		n = readb(f, p, o, c, e->length);
 		if(n == -1){
@@ -1893,12 +2378,10 @@ writeauth(Fmsg *m, Fid *f, Fcall *r)
 static void
 fswrite(Fmsg *m)
 {
-	char sbuf[Wstatmax], kbuf[4][Offksz], vbuf[4][Ptrsz];
+	char sbuf[Wstatmax];
 	char *p, *e;
 	vlong n, o, c;
-	int i, j;
-	Bptr bp[4];
-	Msg kv[4];
+	Msg kv;
 	Fcall r;
 	Fid *f;
 
@@ -1925,16 +2408,27 @@ fswrite(Fmsg *m)
 	p = m->data;
 	o = m->offset;
 	c = m->count;
-	for(i = 0; i < nelem(kv)-1 && c != 0; i++){
-		kv[i].op = Oinsert;
-		kv[i].k = kbuf[i];
-		kv[i].nk = sizeof(kbuf[i]);
-		kv[i].v = vbuf[i];
-		kv[i].nv = sizeof(vbuf[i]);
-		n = writeb(f, &kv[i], &bp[i], p, o, c, f->dent->length);
+	e = nil;
+	if(f->dent->length <= Inlmax){
+		if(o+c <= Inlmax)
+			e = writeinl(f, p, o, c, f->dent->length);
+		else
+			e = uninline(f, f->dent->length);
+		if(e == nil && o+c <= Inlmax)
+			c = 0;
+		else if(e == Eexist)
+			e = nil;
+	}
+	if(e != nil){
+		wunlock(f->dent);
+		fprint(2, "write: %s\n", e);
+		putfid(f);
+		abort();
+		return;
+	}
+	while(c != 0){
+		n = writeb(f, p, o, c, f->dent->length);
 		if(n == -1){
-			for(j = 0; j < i; j++)
-				freebp(f->mnt->root, bp[i]);
 			wunlock(f->dent);
 			fprint(2, "%r");
 			putfid(f);
@@ -1947,9 +2441,9 @@ fswrite(Fmsg *m)
 	}
 
 	p = sbuf;
-	kv[i].op = Owstat;
-	kv[i].k = f->dent->k;
-	kv[i].nk = f->dent->nk;
+	kv.op = Owstat;
+	kv.k = f->dent->k;
+	kv.nk = f->dent->nk;
 	n = m->offset+m->count;
 	*p++ = 0;
 	if(n > f->dent->length){
@@ -1966,9 +2460,9 @@ fswrite(Fmsg *m)
 	PACK32(p, f->uid);
 	p += 4;
 
-	kv[i].v = sbuf;
-	kv[i].nv = p - sbuf;
-	if((e = btupsert(f->mnt->root, kv, i+1)) != nil){
+	kv.v = sbuf;
+	kv.nv = p - sbuf;
+	if((e = btupsert(f->mnt->root, &kv, 1)) != nil){
 		rerror(m, e);
 		putfid(f);
 		abort();
@@ -2118,12 +2612,28 @@ runwrite(int wid, void *)
 			for(mnt = fs->mounts; mnt != nil; mnt = mnt->next)
 				updatemount(mnt);
 			sync();
+			if(m->a->halt)
+				syncwait();
 			freemsg(m);
 			break;
 		case AOsnap:
 			snapfs(m->a->fd, m->a->old, m->a->new);
 			freemsg(m);
 			break;
+		case AOcompact:
+			if(fs->rdonly)
+				fprint(m->a->fd, "compact: %s\n", Erdonly);
+			else
+				compactfs(m->a->fd, m->a->label, m->a->budget);
+			freemsg(m);
+			break;
+		case AOnosum:
+			if(fs->rdonly)
+				fprint(m->a->fd, "nosum: %s\n", Erdonly);
+			else
+				nosumfs(m->a->fd, m->a->label, m->a->nosum);
+			freemsg(m);
+			break;
 		}
 		epochend(wid);
 		epochclean();
@@ -2149,14 +2659,47 @@ runread(int wid, void *)
 	}
 }
 
+/*
+ * A sync is due when the oldest dirty block
+ * has waited syncage ms, when syncdirty bytes
+ * are queued, or when the queues hold synccache
+ * percent of the cache, which they'd otherwise
+ * fill until qput blocks.
+ */
+static int
+syncdue(vlong t0)
+{
+	vlong nq;
+	int i;
+
+	if(nsec() - t0 >= fs->syncage*(Nsec/1000))
+		return 1;
+	if(agetv(&fs->dirtybytes) >= fs->syncdirty)
+		return 1;
+	nq = 0;
+	for(i = 0; i < fs->nsyncers; i++)
+		nq += fs->syncq[i].nheap;
+	if(nq*100 >= (vlong)fs->synccache*fs->cmax)
+		return 1;
+	return 0;
+}
+
 void
 runtasks(int, void *)
 {
 	Fmsg *m;
 	Amsg *a;
+	vlong t0;
 
 	while(1){
-		sleep(5000);
+		/* an idle fs has nothing to sync, so sleep until it's dirtied */
+		qlock(&fs->dirtylk);
+		while(agetv(&fs->dirtyblk) == 0)
+			rsleep(&fs->dirtyrz);
+		qunlock(&fs->dirtylk);
+		t0 = nsec();
+		while(!syncdue(t0))
+			sleep(fs->syncpoll);
 		m = mallocz(sizeof(Fmsg), 1);
 		a = mallocz(sizeof(Amsg), 1);
 		if(m == nil || a == nil){
@@ -2169,6 +2712,10 @@ runtasks(int, void *)
 		a->halt = 0;
 		a->fd = -1;
 		m->a = a;
+		asetl(&fs->syncpending, 1);
 		chsend(fs->wrchan, m);	
+		/* the dirt doesn't go away until the mutator runs it */
+		while(agetl(&fs->syncpending))
+			sleep(fs->syncpoll);
 	}
 }
@@ -102,10 +102,135 @@ siphash(void *src, usize len)
 	return siphash24(src, len, key);
 }
 
+/*
+ * xxhash64: four independent lanes over 32
+ * byte stripes, so the multiplies overlap
+ * instead of waiting on each other like the
+ * siphash rounds do.
+ */
+#define XP1	0x9E3779B185EBCA87ULL
+#define XP2	0xC2B2AE3D27D4EB4FULL
+#define XP3	0x165667B19E3779F9ULL
+#define XP4	0x85EBCA77C2B2AE63ULL
+#define XP5	0x27D4EB2F165667C5ULL
+
+static u64int
+xxround(u64int acc, u64int v)
+{
+	acc += v*XP2;
+	acc = ROTATE(acc, 31);
+	return acc*XP1;
+}
+
+static u64int
+xxmerge(u64int h, u64int v)
+{
+	h ^= xxround(0, v);
+	return h*XP1 + XP4;
+}
+
+uvlong
+xxhash(void *src, usize len)
+{
+	u64int h, v1, v2, v3, v4;
+	uchar *p, *e;
+
+	p = src;
+	e = p + len;
+	if(len >= 32){
+		v1 = XP1 + XP2;
+		v2 = XP2;
+		v3 = 0;
+		v4 = -XP1;
+		for(; e - p >= 32; p += 32){
+			v1 = xxround(v1, GBIT64(p));
+			v2 = xxround(v2, GBIT64(p+8));
+			v3 = xxround(v3, GBIT64(p+16));
+			v4 = xxround(v4, GBIT64(p+24));
+		}
+		h = ROTATE(v1, 1) + ROTATE(v2, 7) + ROTATE(v3, 12) + ROTATE(v4, 18);
+		h = xxmerge(h, v1);
+		h = xxmerge(h, v2);
+		h = xxmerge(h, v3);
+		h = xxmerge(h, v4);
+	}else
+		h = XP5;
+	h += len;
+	for(; e - p >= 8; p += 8){
+		h ^= xxround(0, GBIT64(p));
+		h = ROTATE(h, 27)*XP1 + XP4;
+	}
+	if(e - p >= 4){
+		h ^= (u64int)GBIT32(p)*XP1;
+		h = ROTATE(h, 23)*XP2 + XP3;
+		p += 4;
+	}
+	for(; p < e; p++){
+		h ^= *p*XP5;
+		h = ROTATE(h, 11)*XP1;
+	}
+	h ^= h >> 33;
+	h *= XP2;
+	h ^= h >> 29;
+	h *= XP3;
+	h ^= h >> 32;
+	return h;
+}
+
+/*
+ * The checksum used for blocks is picked
+ * at ream time.
+ */
+uvlong
+bufhash(void *src, usize len)
+{
+	if(fs->hash == Hxx)
+		return xxhash(src, len);
+	return siphash(src, len);
+}
+
+/*
+ * Times the block checksums over Blksz
+ * buffers.
+ */
+void
+benchhash(int fd, int n)
+{
+	char *buf;
+	vlong t0, t1, t2;
+	uvlong r;
+	int i;
+
+	if((buf = malloc(Blksz)) == nil){
+		fprint(fd, "alloc bench buf: %r\n");
+		return;
+	}
+	for(i = 0; i < Blksz; i++)
+		buf[i] = nrand(256);
+	r = 0;
+	t0 = nsec();
+	for(i = 0; i < n; i++)
+		r += siphash(buf, Blksz);
+	t1 = nsec();
+	for(i = 0; i < n; i++)
+		r += xxhash(buf, Blksz);
+	t2 = nsec();
+	USED(r);
+	fprint(fd, "siphash:\t%.2f MiB/s\n", (double)n*Blksz/MiB/((t1 - t0)/1e9));
+	fprint(fd, "xxhash:\t%.2f MiB/s\n", (double)n*Blksz/MiB/((t2 - t1)/1e9));
+	free(buf);
+}
+
 uvlong
 blkhash(Blk *b)
 {
-	return siphash(b->buf, Blksz);
+	if(b->type == Traw && b->clen != 0)
+		return bufhash(b->zbuf, rawsz(b->bp.addr));
+	if(b->type == Traw)
+		return bufhash(b->data, rawsz(b->bp.addr));
+	if(b->clen != 0)
+		return bufhash(b->buf, rawsz(b->bp.addr));
+	return bufhash(b->buf, Blksz);
 }
 
 u32int
@@ -12,16 +12,104 @@ rangecmp(Avl *a, Avl *b)
 	return ((Arange*)a)->off - ((Arange*)b)->off;
 }
 
+/*
+ * Splits the packed space in pivots between
+ * the buffer and the values, and lays out the
+ * unpacked nodes to match: each part unpacks
+ * to at most twice its packed size.
+ */
+char*
+setbufspc(Gefs *fs, int bufspc)
+{
+	if(bufspc <= 2*Msgmax || Pkpivtot - bufspc <= 4*Kpmax){
+		werrstr("buffer size %d out of range", bufspc);
+		return Einval;
+	}
+	fs->bufspc = bufspc;
+	fs->pivspc = Pkpivtot - bufspc;
+	fs->nodepivspc = 2*fs->pivspc + Keymax;
+	fs->nodebufspc = Nodesz - fs->nodepivspc;
+	assert(fs->nodebufspc > 2*fs->bufspc);
+	return nil;
+}
+
+/*
+ * The block size is the size of file data
+ * blocks. Tree nodes, logs and arena headers
+ * are always Blksz.
+ */
+char*
+setblksz(Gefs *fs, int blksz)
+{
+	if(blksz < Blksz || blksz > Maxblksz || (blksz & (blksz-1)) != 0){
+		werrstr("block size %d out of range", blksz);
+		return Einval;
+	}
+	fs->blksz = blksz;
+	return nil;
+}
+
+/*
+ * Picks the block checksum by name.
+ */
+char*
+sethash(Gefs *fs, char *name)
+{
+	if(strcmp(name, "sip") == 0)
+		fs->hash = Hsip;
+	else if(strcmp(name, "xx") == 0)
+		fs->hash = Hxx;
+	else{
+		werrstr("unknown hash %s", name);
+		return Einval;
+	}
+	return nil;
+}
+
+/*
+ * The cache is sized in blocks, so we need to
+ * know the block size before we can load the
+ * arenas through it.
+ */
+int
+devblksz(char *dev)
+{
+	char buf[Blksz];
+	Fshdr fi;
+	Arena a;
+	int fd;
+
+	if((fd = open(dev, OREAD)) == -1)
+		sysfatal("open %s: %r", dev);
+	if(pread(fd, buf, sizeof(buf), 0) != sizeof(buf))
+		sysfatal("read %s: %r", dev);
+	close(fd);
+	if(unpackarena(&a, &fi, buf, sizeof(buf)) == nil)
+		sysfatal("load %s: %r", dev);
+	return fi.blksz;
+}
+
 static void
 mergeinfo(Gefs *fs, Fshdr *fi)
 {
-	if(fi->blksz != Blksz || fi->bufspc != Bufspc)
+	int dedup;
+
+	if(fi->blksz != fs->blksz)
 		sysfatal("parameter mismatch");
+	if(fi->hash != Hsip && fi->hash != Hxx)
+		sysfatal("unknown hash %d", fi->hash);
+	if(fs->gotinfo && fi->hash != fs->hash)
+		sysfatal("hash mismatch");
+	if(setbufspc(fs, fi->bufspc) != nil)
+		sysfatal("parameter mismatch: %r");
 	if(fs->gotinfo && fs->narena != fi->narena)
 		sysfatal("arena count mismatch");
 	if(fs->gotinfo && fi->nextgen != fs->nextgen)
 		fprint(2, "not all arenas synced: rolling back\n");
+	/* if any arena saw shared blocks, there may be some */
+	dedup = fs->gotinfo && fs->dedup;
 	fs->Fshdr = *fi;
+	fs->dedup |= dedup;
 }
 
 int
@@ -78,6 +166,8 @@ loadfs(char *dev)
 		if(a->reserve < 32*MiB)
 			a->reserve = 32*MiB;
 		mergeinfo(fs, &fi);
+		if(a->unit != Fragsz && a->unit != Blksz && a->unit != fs->blksz)
+			sysfatal("loadfs: arena %d: bad unit %d", i, a->unit);
 		if(!fs->gotinfo){
 			if((fs->arenas = realloc(fs->arenas, fs->narena*sizeof(Arena))) == nil)
 				sysfatal("malloc: %r");
@@ -107,8 +197,8 @@ loadfs(char *dev)
 	fprint(2, "\tarenasz:\t%lld MiB\n", fs->arenasz/MiB);
 	fprint(2, "\tnextqid:\t%lld\n", fs->nextqid);
 	fprint(2, "\tnextgen:\t%lld\n", fs->nextgen);
-	fprint(2, "\tblocksize:\t%lld\n", Blksz);
-	fprint(2, "\tcachesz:\t%lld MiB\n", fs->cmax*Blksz/MiB);
+	fprint(2, "\tblocksize:\t%d\n", fs->blksz);
+	fprint(2, "\tcachesz:\t%lld MiB\n", fs->cmax*fs->blksz/MiB);
 	if((t = openlabel("main")) == nil)
 		sysfatal("load users: no main label");
 	if((e = loadusers(2, t)) != nil)
@@ -0,0 +1,174 @@
+#include <u.h>
+#include <libc.h>
+#include <fcall.h>
+#include <avl.h>
+
+#include "dat.h"
+#include "fns.h"
+
+/*
+ * A small LZ77 codec for file data, in the
+ * style of lz4 blocks. The stream is a run of
+ * sequences:
+ *
+ *	tok[1] litlen[n]? lit[litlen] off[2] matchlen[n]?
+ *
+ * The top nibble of tok is the literal count,
+ * the bottom the match length less Minmatch.
+ * A nibble of 15 is followed by bytes that add
+ * to it, up to the first one that isn't 255.
+ * The last sequence stops after its literals.
+ */
+enum {
+	Minmatch	= 4,
+	Lzwin		= (1<<16)-1,
+	Lzhbits		= 12,
+};
+
+static u32int
+lzhash(uchar *p)
+{
+	u32int v;
+
+	v = p[0] | p[1]<<8 | p[2]<<16 | (u32int)p[3]<<24;
+	return (u32int)(v*2654435761U) >> (32-Lzhbits);
+}
+
+static uchar*
+putlen(uchar *d, uchar *e, int n)
+{
+	for(; n >= 255; n -= 255){
+		if(d == e)
+			return nil;
+		*d++ = 255;
+	}
+	if(d == e)
+		return nil;
+	*d++ = n;
+	return d;
+}
+
+static uchar*
+putseq(uchar *d, uchar *e, uchar *lit, int nlit, int off, int mlen)
+{
+	uchar *t;
+
+	if(d == e)
+		return nil;
+	t = d++;
+	*t = ((nlit < 15) ? nlit : 15) << 4;
+	if(nlit >= 15 && (d = putlen(d, e, nlit-15)) == nil)
+		return nil;
+	if(e - d < nlit)
+		return nil;
+	memcpy(d, lit, nlit);
+	d += nlit;
+	if(mlen == 0)
+		return d;
+	if(e - d < 2)
+		return nil;
+	*d++ = off;
+	*d++ = off>>8;
+	mlen -= Minmatch;
+	*t |= (mlen < 15) ? mlen : 15;
+	if(mlen >= 15 && (d = putlen(d, e, mlen-15)) == nil)
+		return nil;
+	return d;
+}
+
+/*
+ * Compresses src into dst, returning the
+ * compressed length, or -1 if it doesn't
+ * fit in ndst bytes.
+ */
+int
+lzenc(char *dst, int ndst, char *src, int nsrc)
+{
+	uchar *s, *e, *p, *m, *lit, *d, *de;
+	int ht[1<<Lzhbits];
+	int i, h, n;
+
+	for(i = 0; i < nelem(ht); i++)
+		ht[i] = -1;
+	s = (uchar*)src;
+	e = s + nsrc;
+	d = (uchar*)dst;
+	de = d + ndst;
+	p = s;
+	lit = s;
+	while(e - p > Minmatch){
+		h = lzhash(p);
+		m = (ht[h] == -1) ? nil : s + ht[h];
+		ht[h] = p - s;
+		if(m == nil || p - m > Lzwin || memcmp(m, p, Minmatch) != 0){
+			/* skip faster through data that doesn't compress */
+			p += 1 + ((p - lit) >> 6);
+			continue;
+		}
+		for(n = Minmatch; p+n < e && m[n] == p[n]; n++)
+			continue;
+		if((d = putseq(d, de, lit, p - lit, p - m, n)) == nil)
+			return -1;
+		p += n;
+		lit = p;
+	}
+	if((d = putseq(d, de, lit, e - lit, 0, 0)) == nil)
+		return -1;
+	return d - (uchar*)dst;
+}
+
+/*
+ * Decompresses nsrc bytes of src into dst,
+ * returning the decompressed length, or -1
+ * if the stream is corrupt.
+ */
+int
+lzdec(char *dst, int ndst, char *src, int nsrc)
+{
+	uchar *s, *e, *d, *de, *m;
+	int t, n, off;
+
+	s = (uchar*)src;
+	e = s + nsrc;
+	d = (uchar*)dst;
+	de = d + ndst;
+	while(s < e){
+		t = *s++;
+		n = t >> 4;
+		if(n == 15){
+			do{
+				if(s == e)
+					return -1;
+				n += *s;
+			}while(*s++ == 255);
+		}
+		if(e - s < n || de - d < n)
+			return -1;
+		memcpy(d, s, n);
+		d += n;
+		s += n;
+		if(s == e)
+			break;
+		if(e - s < 2)
+			return -1;
+		off = s[0] | s[1]<<8;
+		s += 2;
+		if(off == 0 || off > d - (uchar*)dst)
+			return -1;
+		n = t & 15;
+		if(n == 15){
+			do{
+				if(s == e)
+					return -1;
+				n += *s;
+			}while(*s++ == 255);
+		}
+		n += Minmatch;
+		if(de - d < n)
+			return -1;
+		/* matches may overlap what they produce */
+		for(m = d - off; n > 0; n--)
+			*d++ = *m++;
+	}
+	return d - (uchar*)dst;
+}
@@ -13,25 +13,72 @@ int	debug;
 int	stdio;
 int	noauth;
 int	noperm;
+int	lz;
+int	lzmeta;
+int	dedup;
+int	elevator;
+int	nsync;
+int	syncdepth;
 int	nproc;
+int	bufpct = Bufpct;
+int	blksz = Blksz;
+char	*hashname = "sip";
 char	*forceuser;
 char	*srvname = "gefs";
 char	*dev;
 vlong	cachesz = 512*MiB;
 
+static int
+devdepth(char *dev)
+{
+	Dir *d;
+	int n;
+
+	if((d = dirstat(dev)) == nil)
+		sysfatal("stat %s: %r", dev);
+	n = (d->type == 'S') ? Syncdepth : 1;
+	free(d);
+	return n;
+}
+
 static void
-initfs(vlong cachesz)
+initfs(vlong cachesz, int blksz)
 {
 	Blk *b, *buf;
+	vlong slotsz;
+	int i;
 
 	if((fs = mallocz(sizeof(Gefs), 1)) == nil)
 		sysfatal("malloc: %r");
 
 	fs->lrurz.l = &fs->lrulk;
 	fs->syncrz.l = &fs->synclk;
+	fs->dirtyrz.l = &fs->dirtylk;
+	fs->syncpoll = Syncpoll;
+	fs->syncage = Syncage;
+	fs->syncdirty = Syncdirty;
+	fs->synccache = Synccache;
+	for(i = 0; i < nelem(fs->blkrz); i++)
+		fs->blkrz[i].l = &fs->blklk[i];
 	fs->noauth = noauth;
 	fs->noperm = noperm;
-	fs->cmax = cachesz/Blksz;
+	fs->lz = lz;
+	fs->elevator = elevator;
+	if(setblksz(fs, blksz) != nil)
+		sysfatal("%r");
+	/*
+	 * Cache slots keep the buffers they grow:
+	 * an unpacked node with its index, file
+	 * data bigger than Blksz, and compressed
+	 * data when we write it. All of them count
+	 * against the cache size.
+	 */
+	slotsz = sizeof(Blk) + Nodesz + Nodeix*sizeof(u32int) + Bloomsz;
+	if(fs->blksz > Blksz)
+		slotsz += fs->blksz;
+	if(fs->lz)
+		slotsz += fs->blksz;
+	fs->cmax = cachesz/slotsz;
 	if(fs->cmax > (1<<30))
 		sysfatal("cache too big");
 	if((fs->cache = mallocz(fs->cmax*sizeof(Bucket), 1)) == nil)
@@ -44,6 +91,9 @@ initfs(vlong cachesz)
 	for(b = buf; b != buf+fs->cmax; b++){
 		b->bp.addr = -1;
 		b->bp.hash = -1;
+		b->node = nil;
+		b->raw = nil;
+		b->zbuf = nil;
 		b->magic = Magic;
 		lrutop(b);
 	}
@@ -119,7 +169,7 @@ runannounce(int, void *arg)
 static void
 usage(void)
 {
-	fprint(2, "usage: %s [-rA] [-m mem] [-n srv] [-u usr] [-a net]... -f dev\n", argv0);
+	fprint(2, "usage: %s [-rADezZ] [-b bufpct] [-B blksz] [-H hash] [-m mem] [-n srv] [-S nsync] [-W depth] [-u usr] [-a net]... -f dev\n", argv0);
 	exits("usage");
 }
 
@@ -140,6 +190,15 @@ main(int argc, char **argv)
 	case 'r':
 		ream = 1;
 		break;
+	case 'b':
+		bufpct = atoi(EARGF(usage()));
+		break;
+	case 'H':
+		hashname = EARGF(usage());
+		break;
+	case 'B':
+		blksz = strtol(EARGF(usage()), nil, 0)*KiB;
+		break;
 	case 'm':
 		cachesz = strtoll(EARGF(usage()), nil, 0)*MiB;
 		break;
@@ -158,6 +217,24 @@ main(int argc, char **argv)
 	case 'P':
 		noperm = 1;
 		break;
+	case 'z':
+		lz = 1;
+		break;
+	case 'Z':
+		lzmeta = 1;
+		break;
+	case 'D':
+		dedup = 1;
+		break;
+	case 'e':
+		elevator = 1;
+		break;
+	case 'S':
+		nsync = atoi(EARGF(usage()));
+		break;
+	case 'W':
+		syncdepth = atoi(EARGF(usage()));
+		break;
 	case 'u':
 		forceuser = EARGF(usage());
 		break;
@@ -175,11 +252,11 @@ main(int argc, char **argv)
 	 * sanity checks -- I've tuned these to stupid
 	 * values in the past.
 	 */
-	assert(4*Kpmax < Pivspc);
-	assert(2*Msgmax < Bufspc);
 	assert(Treesz < Inlmax);
 
-	initfs(cachesz);
+	if(!ream)
+		blksz = devblksz(dev);
+	initfs(cachesz, blksz);
 	initshow();
 	fmtinstall('H', encodefmt);
 	fmtinstall('B', Bconv);
@@ -202,17 +279,36 @@ main(int argc, char **argv)
 	if(nproc > 6)
 		nproc = 6;
 	if(ream){
-		reamfs(dev);
+		if(sethash(fs, hashname) != nil)
+			sysfatal("ream: %r");
+		fs->dedup = dedup;
+		reamfs(dev, bufpct);
 		exits(nil);
 	}
 
 	loadfs(dev);
+	fs->lzmeta = lzmeta;
+	/*
+	 * Once blocks may be shared, frees have to go
+	 * through the table for good, so the header
+	 * keeps the mode and -D can only turn it on.
+	 */
+	if(dedup)
+		fs->dedup = 1;
 
 	fs->rdchan = mkchan(32);
 	fs->wrchan = mkchan(32);
-	fs->nsyncers = 2;
+	/*
+	 * A queue per arena keeps them all writing,
+	 * and disks take a few writes per queue in
+	 * flight. Files are left with one.
+	 */
+	fs->nsyncers = (nsync > 0) ? nsync : fs->narena;
 	if(fs->nsyncers > fs->narena)
 		fs->nsyncers = fs->narena;
+	if(fs->nsyncers > nelem(fs->syncq))
+		fs->nsyncers = nelem(fs->syncq);
+	fs->syncdepth = (syncdepth > 0) ? syncdepth : devdepth(dev);
 	for(i = 0; i < fs->nsyncers; i++)
 		qinit(&fs->syncq[i]);
 	for(i = 0; i < fs->narena; i++)
@@ -224,8 +320,8 @@ main(int argc, char **argv)
 	launch(runwrite, fs->nworker++, nil, "mutate");
 	for(i = 0; i < 2; i++)
 		launch(runread, fs->nworker++, nil, "readio");
-	for(i = 0; i < fs->nsyncers; i++)
-		launch(runsync, -1, &fs->syncq[i], "syncio");
+	for(i = 0; i < fs->nsyncers*fs->syncdepth; i++)
+		launch(runsync, -1, &fs->syncq[i%fs->nsyncers], "syncio");
 	for(i = 0; i < nann; i++)
 		launch(runannounce, -1, ann[i], "announce");
 	if(srvfd != -1){
@@ -387,6 +387,70 @@ unpackbp(char *p, int sz)
 	return bp;
 }
 
+/*
+ * A single block extent packs the same
+ * way as a block pointer; the hashes of
+ * any later blocks follow it. Compressed
+ * blocks are followed by the codec and
+ * length instead, which can't be confused
+ * with a run of hashes.
+ */
+char*
+packext(char *p, int sz, Ext *x)
+{
+	int i;
+
+	assert(x->nblk >= 1 && x->nblk <= Extmax);
+	assert(sz >= Ptrsz + 8*(x->nblk-1));
+	p = packbp(p, sz, &x->bp[0]);
+	assert((x->bp[0].addr & Xflags) == 0);
+	PACK64(p-Ptrsz, x->bp[0].addr | (x->flag & Xflags));
+	if(x->codec != Znone){
+		assert(x->nblk == 1 && sz >= Zextsz);
+		PACK8(p, x->codec);	p += 1;
+		PACK32(p, x->clen);	p += 4;
+		return p;
+	}
+	for(i = 1; i < x->nblk; i++){
+		assert(x->bp[i].addr == x->bp[0].addr + i*fs->blksz);
+		assert(x->bp[i].gen == x->bp[0].gen);
+		PACK64(p, x->bp[i].hash);	p += 8;
+	}
+	return p;
+}
+
+Ext*
+unpackext(Ext *x, char *p, int sz)
+{
+	int i;
+
+	if(sz == Zextsz){
+		x->nblk = 1;
+		x->bp[0] = unpackbp(p, sz);
+		x->flag = x->bp[0].addr & Xflags;
+		x->bp[0].addr &= ~Xflags;
+		p += Ptrsz;
+		x->codec = UNPACK8(p);	p += 1;
+		x->clen = UNPACK32(p);	p += 4;
+		return x;
+	}
+	assert(sz >= Ptrsz && (sz - Ptrsz) % 8 == 0);
+	x->codec = Znone;
+	x->clen = 0;
+	x->nblk = 1 + (sz - Ptrsz)/8;
+	assert(x->nblk <= Extmax);
+	x->bp[0] = unpackbp(p, sz);
+	x->flag = x->bp[0].addr & Xflags;
+	x->bp[0].addr &= ~Xflags;
+	p += Ptrsz;
+	for(i = 1; i < x->nblk; i++){
+		x->bp[i].addr = x->bp[0].addr + i*fs->blksz;
+		x->bp[i].hash = UNPACK64(p);	p += 8;
+		x->bp[i].gen = x->bp[0].gen;
+	}
+	return x;
+}
+
 Tree*
 unpacktree(Tree *t, char *p, int sz)
 {
@@ -411,6 +475,7 @@ unpacktree(Tree *t, char *p, int sz)
 		bp->gen = -1;
 		t->dead[i].ins	= nil;	/* loaded on demand */
 	}
+	t->flag = UNPACK32(p);		p += 4;
 	return t;
 }
 
@@ -439,6 +504,7 @@ packtree(char *p, int sz, Tree *t)
 		PACK64(p, bp.addr);	p += 8;
 		PACK64(p, bp.hash);	p += 8;
 	}
+	PACK32(p, t->flag);	p += 4;
 	return p;
 }
 
@@ -446,9 +512,9 @@ char*
 packarena(char *p, int sz, Arena *a, Fshdr *fi)
 {
 	assert(sz == Blksz);
-	memcpy(p, "gefs0001", 8);	p += 8;
-	PACK32(p, Blksz);		p += 4;
-	PACK32(p, Bufspc);		p += 4;
+	memcpy(p, "gefs0002", 8);	p += 8;
+	PACK32(p, fi->blksz);		p += 4;
+	PACK32(p, fi->bufspc);		p += 4;
 	PACK32(p, fi->snap.ht);		p += 4;
 	PACK64(p, fi->snap.bp.addr);	p += 8;
 	PACK64(p, fi->snap.bp.hash);	p += 8;
@@ -460,6 +526,9 @@ packarena(char *p, int sz, Arena *a, Fshdr *fi)
 	PACK64(p, a->head.hash);	p += 8;	/* freelist hash */
 	PACK64(p, a->size);		p += 8;	/* arena size */
 	PACK64(p, a->used);		p += 8;	/* arena used */
+	PACK32(p, a->unit);		p += 4;	/* arena unit */
+	PACK32(p, fi->hash);		p += 4;	/* block checksum */
+	PACK32(p, fi->dedup);		p += 4;	/* blocks may be shared */
 	return p;
 }
 
@@ -469,7 +538,11 @@ unpackarena(Arena *a, Fshdr *fi, char *p, int sz)
 	assert(sz == Blksz);
 	memset(a, 0, sizeof(*a));
 	memset(fi, 0, sizeof(*fi));
-	if(memcmp(p, "gefs0001", 8) != 0){
+	if(memcmp(p, "gefs", 4) == 0 && memcmp(p, "gefs0002", 8) != 0){
+		werrstr("unsupported format %.8s, want gefs0002: ream it", p);
+		return nil;
+	}
+	if(memcmp(p, "gefs0002", 8) != 0){
 		werrstr("wrong block header %.8s\n", p);
 		return nil;
 	}
@@ -489,6 +562,9 @@ unpackarena(Arena *a, Fshdr *fi, char *p, int sz)
 	a->head.gen = -1;		p += 0;
 	a->size = UNPACK64(p);		p += 8;
 	a->used = UNPACK64(p);		p += 8;
+	a->unit = UNPACK32(p);		p += 4;
+	fi->hash = UNPACK32(p);		p += 4;
+	fi->dedup = UNPACK32(p);		p += 4;
 	a->tail = nil;
 	return p;
 }
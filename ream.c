@@ -79,14 +79,16 @@ initsnap(Blk *s, Blk *r)
 }
 
 static void
-initarena(Arena *a, Fshdr *fi, vlong start, vlong asz)
+initarena(Arena *a, Fshdr *fi, vlong start, vlong asz, int unit)
 {
-	vlong addr, bo, bh;
+	vlong addr, bo, bh, hdsz;
 	char *p;
 	Blk *b;
 
+	/* the header and log take a Blksz block each */
+	hdsz = Blksz;
 	b = cachepluck();
-	addr = start+Blksz;	/* arena header */
+	addr = start+hdsz;	/* arena header */
 
 	a->head.addr = -1;
 	a->head.hash = -1;
@@ -101,9 +103,9 @@ initarena(Arena *a, Fshdr *fi, vlong start, vlong asz)
 
 	p = b->data + Loghashsz;
 	PACK64(p, addr|LogFree);	p += 8;	/* addr */
-	PACK64(p, asz-Blksz);		p += 8;	/* len */
+	PACK64(p, asz-hdsz);		p += 8;	/* len */
 	PACK64(p, b->bp.addr|LogAlloc);	p += 8;	/* addr */
-	PACK64(p, Blksz);		p += 8;	/* len */
+	PACK64(p, hdsz);		p += 8;	/* len */
 	PACK64(p, (uvlong)LogEnd);	/* done */
 	finalize(b);
 	if(syncblk(b) == -1)
@@ -122,7 +124,8 @@ initarena(Arena *a, Fshdr *fi, vlong start, vlong asz)
 	a->head.hash = bh;
 	a->head.gen = -1;
 	a->size = asz;
-	a->used = Blksz;
+	a->used = hdsz;
+	a->unit = unit;
 	a->tail = nil;
 	packarena(b->data, Blksz, a, fi);
 	finalize(b);
@@ -132,15 +135,17 @@ initarena(Arena *a, Fshdr *fi, vlong start, vlong asz)
 }
 
 void
-reamfs(char *dev)
+reamfs(char *dev, int bufpct)
 {
 	vlong sz, asz, off;
 	Blk *rb, *tb;
 	Mount *mnt;
 	Arena *a;
 	Dir *d;
-	int i;
+	int i, unit;
 
+	if(setbufspc(fs, Pkpivtot*bufpct/100) != nil)
+		sysfatal("ream: %r");
 	if((fs->fd = open(dev, ORDWR)) == -1)
 		sysfatal("open %s: %r", dev);
 	if((d = dirfstat(fs->fd)) == nil)
@@ -163,14 +168,25 @@ reamfs(char *dev)
 		sysfatal("malloc: %r");
 
 	asz = sz/fs->narena;
-	asz = asz - (asz % Blksz) - Blksz;
+	asz = asz - (asz % fs->blksz) - fs->blksz;
 	if(asz < 128*MiB)
 		sysfatal("disk too small");
 	fs->arenasz = asz;
 	off = 0;
 	for(i = 0; i < fs->narena; i++){
-		print("\tarena %d: %lld blocks at %llx\n", i, asz/Blksz, off);
-		initarena(&fs->arenas[i], fs, off, asz);
+		/*
+		 * Start with one arena for metadata and
+		 * one for file tails. Empty arenas move
+		 * to whichever unit runs out of room,
+		 * so this only needs to be a start.
+		 */
+		unit = fs->blksz;
+		if(i == 0)
+			unit = Blksz;
+		if(i == fs->narena-1)
+			unit = Fragsz;
+		print("\tarena %d: %lld blocks of %d at %llx\n", i, asz/unit, unit, off);
+		initarena(&fs->arenas[i], fs, off, asz, unit);
 		off += asz;
 	}
 	for(i = 0; i < Ndead; i++){
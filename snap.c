@@ -430,6 +430,7 @@ newsnap(Tree *t)
 	r->ht = t->ht;
 	r->bp = t->bp;
 	r->gen = gen;
+	r->flag = t->flag;
 	r->dirty = 0;
 	/* shift deadlist down */
 	for(i = Ndead-1; i >= 0; i--){
@@ -443,3 +444,138 @@ newsnap(Tree *t)
 
 	return r;
 }
+
+/*
+ * The dedup table lives in the snap tree. Data
+ * blocks are entered by hash as they're written,
+ * and a later block with the same contents shares
+ * the first copy instead. References beyond the
+ * first are counted under the block's address, so
+ * only shared blocks pay for a count.
+ */
+static vlong
+getdref(vlong addr)
+{
+	char kbuf[1+8], buf[Kvmax];
+	Kvp kv;
+	Key k;
+
+	kbuf[0] = Kdref;
+	PACK64(kbuf+1, addr);
+	k.k = kbuf;
+	k.nk = sizeof(kbuf);
+	if(btlookup(&fs->snap, &k, &kv, buf, sizeof(buf)) != nil)
+		return 0;
+	return UNPACK64(kv.v);
+}
+
+static char*
+setdref(vlong addr, vlong ref)
+{
+	char kbuf[1+8], vbuf[8];
+	Msg m;
+
+	kbuf[0] = Kdref;
+	PACK64(kbuf+1, addr);
+	PACK64(vbuf, ref);
+	m.op = (ref == 0) ? Odelete : Oinsert;
+	m.k = kbuf;
+	m.nk = sizeof(kbuf);
+	m.v = (ref == 0) ? nil : vbuf;
+	m.nv = (ref == 0) ? 0 : sizeof(vbuf);
+	return btupsert(&fs->snap, &m, 1);
+}
+
+int
+dedupshared(vlong addr)
+{
+	return getdref(addr) > 0;
+}
+
+/*
+ * Looks for a block holding the same data as
+ * the unwritten block b. If there's one, takes
+ * a reference to it, returns it in r, and the
+ * caller can drop b. Otherwise b goes in the
+ * table for later writes to find.
+ */
+int
+dedupblk(Blk *b, Bptr *r)
+{
+	char kbuf[1+8], vbuf[Ptrsz], buf[Kvmax];
+	Bptr bp;
+	Kvp kv;
+	Key k;
+	Msg m;
+
+	assert(b->type == Traw && b->clen == 0);
+	kbuf[0] = Kdedup;
+	PACK64(kbuf+1, blkhash(b));
+	k.k = kbuf;
+	k.nk = sizeof(kbuf);
+	if(btlookup(&fs->snap, &k, &kv, buf, sizeof(buf)) == nil){
+		bp = unpackbp(kv.v, kv.nv);
+		/* the hash only picks a candidate; the contents decide */
+		if(rawsz(bp.addr) == rawsz(b->bp.addr) && blkinuse(bp.addr)
+		&& blkmatch(bp.addr, b) && setdref(bp.addr, getdref(bp.addr)+1) == nil){
+			*r = bp;
+			return 1;
+		}
+	}
+	bp = b->bp;
+	bp.hash = UNPACK64(kbuf+1);
+	m.op = Oinsert;
+	m.k = kbuf;
+	m.nk = sizeof(kbuf);
+	m.v = vbuf;
+	m.nv = packbp(vbuf, sizeof(vbuf), &bp) - vbuf;
+	btupsert(&fs->snap, &m, 1);
+	return 0;
+}
+
+/*
+ * Takes bp out of the table, if its hash still
+ * leads there, so that nothing finds it once its
+ * contents change.
+ */
+void
+dedupdrop(Bptr bp)
+{
+	char kbuf[1+8], buf[Kvmax];
+	Kvp kv;
+	Key k;
+	Msg m;
+
+	kbuf[0] = Kdedup;
+	PACK64(kbuf+1, bp.hash);
+	k.k = kbuf;
+	k.nk = sizeof(kbuf);
+	if(btlookup(&fs->snap, &k, &kv, buf, sizeof(buf)) != nil)
+		return;
+	if(unpackbp(kv.v, kv.nv).addr != bp.addr)
+		return;
+	m.op = Odelete;
+	m.k = kbuf;
+	m.nk = sizeof(kbuf);
+	m.v = nil;
+	m.nv = 0;
+	btupsert(&fs->snap, &m, 1);
+}
+
+/*
+ * Called as a block is about to go back to its
+ * arena. Returns 1 if the block is shared, and
+ * only dropped a reference.
+ */
+int
+dedupfree(Bptr bp)
+{
+	vlong ref;
+
+	if((ref = getdref(bp.addr)) > 0){
+		setdref(bp.addr, ref-1);
+		return 1;
+	}
+	dedupdrop(bp);
+	return 0;
+}
@@ -7,6 +7,7 @@
 #include "fns.h"
 
 typedef struct Path	Path;
+typedef struct Compact	Compact;
 
 struct Path {
 	/* Flowing down for flush */
@@ -27,6 +28,19 @@ struct Path {
 	int	pullsz;	/* size of pulled messages */
 };
 
+struct Compact {
+	Tree	*t;
+	int	budget;	/* nodes left to rewrite */
+	Key	*start;	/* resume from here */
+	int	stopped;	/* ran out of budget at next */
+	Key	next;
+	char	nextbuf[Keymax];
+	Blk	**old;	/* freed once the new root is in */
+	int	nold;
+	Blk	**new;	/* freed if we fail */
+	int	nnew;
+};
+
 static void
 stablesort(Msg *m, int nm)
 {
@@ -65,8 +79,8 @@ cpkvp(Kvp *dst, Kvp *src, char *buf, int nbuf)
 	dst->nv = src->nv;
 }
 
-int
-keycmp(Key *a, Key *b)
+static int
+keycmpmem(Key *a, Key *b)
 {
 	int c, n;
 
@@ -81,6 +95,115 @@ keycmp(Key *a, Key *b)
 		return 0;
 }
 
+/*
+ * Most key types are a type byte followed by
+ * fixed width big endian integers, which sort
+ * the same as the integers do, so we can skip
+ * the byte at a time compare for them.
+ */
+int
+keycmp(Key *a, Key *b)
+{
+	uvlong x, y;
+
+	if(a->nk == 0 || b->nk == 0)
+		return keycmpmem(a, b);
+	if(a->k[0] != b->k[0])
+		return ((uchar)a->k[0] < (uchar)b->k[0]) ? -1 : 1;
+	if(a->nk != b->nk)
+		return keycmpmem(a, b);
+	switch(a->k[0]){
+	case Kdat:
+		if(a->nk != 1+8+8)
+			break;
+		x = UNPACK64(a->k+1);
+		y = UNPACK64(b->k+1);
+		if(x != y)
+			return (x < y) ? -1 : 1;
+		x = UNPACK64(a->k+9);
+		y = UNPACK64(b->k+9);
+		if(x != y)
+			return (x < y) ? -1 : 1;
+		return 0;
+	case Ktref:
+	case Ksnap:
+	case Ksuper:
+	case Kinl:
+	case Kdedup:
+	case Kdref:
+		if(a->nk != 1+8)
+			break;
+		x = UNPACK64(a->k+1);
+		y = UNPACK64(b->k+1);
+		if(x != y)
+			return (x < y) ? -1 : 1;
+		return 0;
+	}
+	return keycmpmem(a, b);
+}
+
+/*
+ * Times keycmp against the plain byte compare
+ * over a mix of data and directory keys.
+ */
+void
+benchkeycmp(int fd, int n)
+{
+	char *buf, *p, name[32];
+	vlong t0, t1, t2;
+	int i, r0, r1, nkey;
+	Key *k;
+
+	nkey = 1024;
+	buf = malloc(nkey*Keymax);
+	k = malloc(nkey*sizeof(Key));
+	if(buf == nil || k == nil){
+		fprint(fd, "alloc bench keys: %r\n");
+		goto Out;
+	}
+	for(i = 0; i < nkey; i++){
+		p = buf + i*Keymax;
+		k[i].k = p;
+		if(i % 4 == 3){
+			snprint(name, sizeof(name), "file%d", nrand(nkey));
+			p = packdkey(p, Keymax, nrand(8), name);
+		}else{
+			p[0] = Kdat;
+			PACK64(p+1, (uvlong)nrand(8));
+			PACK64(p+9, (uvlong)nrand(1<<20)*Blksz);
+			p += 1+8+8;
+		}
+		k[i].nk = p - k[i].k;
+	}
+	/* every pair must order the same way */
+	for(i = 0; i < n; i++){
+		r0 = keycmpmem(&k[i%nkey], &k[(7*i+1)%nkey]);
+		r1 = keycmp(&k[i%nkey], &k[(7*i+1)%nkey]);
+		if((r0 > 0) - (r0 < 0) != (r1 > 0) - (r1 < 0)){
+			fprint(fd, "keycmp mismatch: %K vs %K: %d != %d\n",
+				&k[i%nkey], &k[(7*i+1)%nkey], r0, r1);
+			break;
+		}
+	}
+	/* the sums keep the loops from being optimized away */
+	r0 = 0;
+	t0 = nsec();
+	for(i = 0; i < n; i++)
+		r0 += keycmpmem(&k[i%nkey], &k[(7*i+1)%nkey]);
+	t1 = nsec();
+	r1 = 0;
+	for(i = 0; i < n; i++)
+		r1 += keycmp(&k[i%nkey], &k[(7*i+1)%nkey]);
+	t2 = nsec();
+	USED(r0);
+	USED(r1);
+	fprint(fd, "memcmp:\t%.2f ns/cmp\n", (double)(t1 - t0)/n);
+	fprint(fd, "keycmp:\t%.2f ns/cmp\n", (double)(t2 - t1)/n);
+Out:
+	free(buf);
+	free(k);
+}
+
 static int
 msgsz(Msg *m)
 {
@@ -116,14 +239,77 @@ getptr(Kvp *kv, int *fill)
 	return unpackbp(kv->v, kv->nv);
 }
 
+/*
+ * The number of key bytes an entry shares with
+ * the one before it when packed. This is capped
+ * so that no entry unpacks to more than twice
+ * its packed size.
+ */
+static int
+pkshare(Kvp *prev, Kvp *kv)
+{
+	int i, n;
+
+	n = (4 + kv->nk + kv->nv)/2;
+	if(n > kv->nk)
+		n = kv->nk;
+	if(n > prev->nk)
+		n = prev->nk;
+	if(n > 255)
+		n = 255;
+	for(i = 0; i < n; i++)
+		if(prev->k[i] != kv->k[i])
+			break;
+	return i;
+}
+
+static int
+pkvalsz(Kvp *prev, Kvp *kv)
+{
+	int sh;
+
+	sh = (prev == nil) ? 0 : pkshare(prev, kv);
+	return 1 + 2 + kv->nk - sh + 2 + kv->nv;
+}
+
+/*
+ * Packed size of the buffer, leaving out
+ * the n messages starting at lo.
+ */
+static int
+pkbufsz(Blk *b, int lo, int n)
+{
+	Msg m, pm, *prev;
+	int i, sz;
+
+	sz = 0;
+	prev = nil;
+	for(i = 0; i < b->nbuf; i++){
+		if(i >= lo && i < lo+n)
+			continue;
+		getmsg(b, i, &m);
+		sz += 1 + pkvalsz(prev, &m);
+		pm = m;
+		prev = &pm;
+	}
+	return sz;
+}
+
 /* Exported for reaming */
 void
 setval(Blk *b, Kvp *kv)
 {
 	int off, spc;
 	char *p;
-
-	spc = (b->type == Tleaf) ? Leafspc : Pivspc;
+	Kvp pv;
+
+	spc = (b->type == Tleaf) ? Leafspc : fs->nodepivspc;
+	if(b->nval == 0)
+		b->pvalsz += pkvalsz(nil, kv);
+	else{
+		getval(b, b->nval-1, &pv);
+		b->pvalsz += pkvalsz(&pv, kv);
+	}
 	b->valsz += 2 + kv->nk + 2 + kv->nv;
 	off = spc - b->valsz;
 
@@ -162,15 +348,22 @@ setmsg(Blk *b, Msg *m)
 {
 	char *p;
 	int o;
+	Msg pm;
 
 	assert(b->type == Tpivot);
+	if(b->nbuf == 0)
+		b->pbufsz += 1 + pkvalsz(nil, m);
+	else{
+		getmsg(b, b->nbuf-1, &pm);
+		b->pbufsz += 1 + pkvalsz(&pm, m);
+	}
 	b->bufsz += msgsz(m)-2;
 
-	p = b->data + Pivspc + 2*b->nbuf;
-	o = Bufspc - b->bufsz;
+	p = b->data + fs->nodepivspc + 2*b->nbuf;
+	o = fs->nodebufspc - b->bufsz;
 	PACK16(p, o);
 
-	p = b->data + Pivspc + o;
+	p = b->data + fs->nodepivspc + o;
 	*p = m->op;		p += 1;
 	PACK16(p, m->nk);	p += 2;
 	memcpy(p, m->k, m->nk);	p += m->nk;
@@ -188,8 +381,8 @@ getmsg(Blk *b, int i, Msg *m)
 
 	assert(b->type == Tpivot);
 	assert(i >= 0 && i < b->nbuf);
-	o = UNPACK16(b->data + Pivspc + 2*i);
-	p = b->data + Pivspc + o;
+	o = UNPACK16(b->data + fs->nodepivspc + 2*i);
+	p = b->data + fs->nodepivspc + o;
 	m->op = *p;
 	m->nk = UNPACK16(p + 1);
 	m->k = p + 3;
@@ -197,6 +390,304 @@ getmsg(Blk *b, int i, Msg *m)
 	m->v = p + 5 + m->nk;
 }
 
+static char*
+packkv(char *p, Kvp *kv, Kvp *prev)
+{
+	int sh;
+
+	sh = (prev == nil) ? 0 : pkshare(prev, kv);
+	*p++ = sh;
+	PACK16(p, kv->nk - sh);			p += 2;
+	memcpy(p, kv->k + sh, kv->nk - sh);	p += kv->nk - sh;
+	PACK16(p, kv->nv);			p += 2;
+	memcpy(p, kv->v, kv->nv);		p += kv->nv;
+	return p;
+}
+
+/*
+ * Tree nodes are only packed into their block
+ * when they get written out; the layout is
+ * described in dat.h.
+ */
+void
+packnode(Blk *b)
+{
+	Msg m, pm;
+	Kvp kv, pv;
+	char *p;
+	int i;
+
+	p = b->buf;
+	PACK16(p, b->type);	p += 2;
+	PACK16(p, b->nval);	p += 2;
+	if(b->type == Tpivot){
+		PACK16(p, b->nbuf);
+		p += 2;
+	}
+	for(i = 0; i < b->nval; i++){
+		getval(b, i, &kv);
+		p = packkv(p, &kv, (i == 0) ? nil : &pv);
+		pv = kv;
+	}
+	for(i = 0; i < b->nbuf; i++){
+		getmsg(b, i, &m);
+		*p++ = m.op;
+		p = packkv(p, &m, (i == 0) ? nil : &pm);
+		pm = m;
+	}
+	assert(p - b->buf == blkfill(b) + ((b->type == Tpivot) ? Pivhdsz : Leafhdsz));
+	assert(p - b->buf <= Blksz);
+	memset(p, 0, Blksz - (p - b->buf));
+}
+
+static char*
+unpackkv(char *p, char *e, Kvp *kv, Kvp *prev, char *kbuf, int nkbuf)
+{
+	int sh, n;
+
+	if(e - p < 3)
+		return nil;
+	sh = p[0] & 0xff;
+	n = UNPACK16(p+1);
+	p += 3;
+	if(sh > ((prev == nil) ? 0 : prev->nk) || sh + n > nkbuf || e - p < n + 2)
+		return nil;
+	if(sh > 0)
+		memmove(kbuf, prev->k, sh);
+	memcpy(kbuf + sh, p, n);
+	p += n;
+	kv->k = kbuf;
+	kv->nk = sh + n;
+	kv->nv = UNPACK16(p);
+	p += 2;
+	if(e - p < kv->nv)
+		return nil;
+	kv->v = p;
+	return p + kv->nv;
+}
+
+/*
+ * Rebuilds the in memory node from the packed
+ * block contents.
+ */
+int
+unpacknode(Blk *b)
+{
+	char *p, *e, kbuf[Kvmax];
+	int i, nval, nbuf;
+	Msg m, pm;
+	Kvp kv, pv;
+
+	p = b->buf + 2;
+	e = b->buf + Blksz;
+	nval = UNPACK16(p);
+	p += 2;
+	nbuf = 0;
+	if(b->type == Tpivot){
+		nbuf = UNPACK16(p);
+		p += 2;
+	}
+	b->nval = 0;
+	b->valsz = 0;
+	b->nbuf = 0;
+	b->bufsz = 0;
+	b->pvalsz = 0;
+	b->pbufsz = 0;
+	for(i = 0; i < nval; i++){
+		if((p = unpackkv(p, e, &kv, (i == 0) ? nil : &pv, kbuf, sizeof(kbuf))) == nil)
+			goto Corrupt;
+		setval(b, &kv);
+		getval(b, i, &pv);
+	}
+	for(i = 0; i < nbuf; i++){
+		if(p == e)
+			goto Corrupt;
+		m.op = *p++;
+		if((p = unpackkv(p, e, &m, (i == 0) ? nil : &pm, kbuf, sizeof(kbuf))) == nil)
+			goto Corrupt;
+		setmsg(b, &m);
+		getmsg(b, i, &pm);
+	}
+	return 0;
+Corrupt:
+	werrstr("corrupt node");
+	return -1;
+}
+
+static u32int
+ixkey(Key *k, int pfx)
+{
+	u32int v;
+	int i;
+
+	v = 0;
+	for(i = pfx; i < pfx+4; i++){
+		v <<= 8;
+		if(i < k->nk)
+			v |= k->k[i] & 0xff;
+	}
+	return v;
+}
+
+static int
+ixpfx(Key *a, Key *b)
+{
+	int i, n;
+
+	n = (a->nk < b->nk) ? a->nk : b->nk;
+	for(i = 0; i < n; i++)
+		if(a->k[i] != b->k[i])
+			break;
+	return i;
+}
+
+static uvlong
+bloomhash(Key *k)
+{
+	uvlong h;
+	int i;
+
+	/* fnv-1a */
+	h = 0xcbf29ce484222325ULL;
+	for(i = 0; i < k->nk; i++){
+		h ^= k->k[i] & 0xff;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static void
+bloomset(uchar *f, uvlong h)
+{
+	uint a, b;
+
+	a = h % (8*Bloomsz);
+	b = (h >> 32) % (8*Bloomsz);
+	f[a/8] |= 1<<(a%8);
+	f[b/8] |= 1<<(b%8);
+}
+
+/*
+ * Returns whether the buffer of b may hold a
+ * message for k. Most lookups have nothing
+ * buffered for their key along the path, and
+ * this lets them skip the buffer search.
+ */
+static int
+bufmaybe(Blk *b, Key *k)
+{
+	uvlong h;
+	uint x, y;
+
+	if(b->ixnbuf != b->nbuf)
+		return 1;
+	if(b->nbuf == 0)
+		return 0;
+	h = bloomhash(k);
+	x = h % (8*Bloomsz);
+	y = (h >> 32) % (8*Bloomsz);
+	return (b->bloom[x/8] & (1<<(x%8))) && (b->bloom[y/8] & (1<<(y%8)));
+}
+
+/*
+ * Builds the search index for a finished node.
+ * All keys in a node share the prefix between the
+ * first and last key, so for each entry we keep
+ * the 4 bytes past that prefix in a dense array.
+ * The order of the array follows the key order,
+ * so searches can bisect it without chasing the
+ * offsets into the node, and only need to compare
+ * full keys among the entries that tie.
+ *
+ * Pivots also get a bloom filter over the keys in
+ * their buffer. Nodes are never changed once they
+ * are finalized, so fastupsert gets its filter
+ * rebuilt along with the index when it enqueues
+ * the new node.
+ */
+void
+mkindex(Blk *b)
+{
+	Msg m, mz;
+	Kvp kv, kz;
+	int i;
+
+	assert(b->nval + b->nbuf <= Nodeix);
+	b->ixval = (u32int*)(b->node + Nodesz);
+	b->ixbuf = b->ixval + b->nval;
+	b->bloom = (uchar*)(b->ixval + Nodeix);
+	memset(b->bloom, 0, Bloomsz);
+	b->ixvpfx = 0;
+	b->ixbpfx = 0;
+	if(b->nval > 0){
+		getval(b, 0, &kv);
+		getval(b, b->nval-1, &kz);
+		b->ixvpfx = ixpfx(&kv, &kz);
+	}
+	for(i = 0; i < b->nval; i++){
+		getval(b, i, &kv);
+		b->ixval[i] = ixkey(&kv, b->ixvpfx);
+	}
+	if(b->nbuf > 0){
+		getmsg(b, 0, &m);
+		getmsg(b, b->nbuf-1, &mz);
+		b->ixbpfx = ixpfx(&m, &mz);
+	}
+	for(i = 0; i < b->nbuf; i++){
+		getmsg(b, i, &m);
+		b->ixbuf[i] = ixkey(&m, b->ixbpfx);
+		bloomset(b->bloom, bloomhash(&m));
+	}
+	b->ixnval = b->nval;
+	b->ixnbuf = b->nbuf;
+}
+
+/*
+ * Narrows the range [lo, hi] of the n indexed
+ * entries that may compare equal to k. The
+ * first entry f carries the shared prefix.
+ */
+static void
+ixrange(u32int *ix, int n, Key *f, int pfx, Key *k, int *lo, int *hi)
+{
+	int c, l, h, m;
+	u32int kx;
+
+	c = memcmp(k->k, f->k, (k->nk < pfx) ? k->nk : pfx);
+	if(c == 0 && k->nk < pfx)
+		c = -1;
+	if(c < 0){
+		*lo = 0;
+		*hi = -1;
+		return;
+	}
+	if(c > 0){
+		*lo = n;
+		*hi = n-1;
+		return;
+	}
+	kx = ixkey(k, pfx);
+	l = 0;
+	h = n;
+	while(l < h){
+		m = (l + h) / 2;
+		if(ix[m] < kx)
+			l = m+1;
+		else
+			h = m;
+	}
+	*lo = l;
+	h = n;
+	while(l < h){
+		m = (l + h) / 2;
+		if(ix[m] <= kx)
+			l = m+1;
+		else
+			h = m;
+	}
+	*hi = l-1;
+}
+
 static int
 bufsearch(Blk *b, Key *k, Msg *m, int *same)
 {
@@ -206,6 +697,10 @@ bufsearch(Blk *b, Key *k, Msg *m, int *same)
 	ri = -1;
 	lo = 0;
 	hi = b->nbuf-1;
+	if(b->nbuf > 0 && b->ixnbuf == b->nbuf){
+		getmsg(b, 0, &cmp);
+		ixrange(b->ixbuf, b->nbuf, &cmp, b->ixbpfx, k, &lo, &hi);
+	}
 	while(lo <= hi){
 		mid = (hi + lo) / 2;
 		getmsg(b, mid, &cmp);
@@ -247,6 +742,10 @@ blksearch(Blk *b, Key *k, Kvp *rp, int *same)
 	ri = -1;
 	lo = 0;
 	hi = b->nval-1;
+	if(b->nval > 0 && b->ixnval == b->nval){
+		getval(b, 0, &cmp);
+		ixrange(b->ixval, b->nval, &cmp, b->ixvpfx, k, &lo, &hi);
+	}
 	while(lo <= hi){
 		mid = (hi + lo) / 2;
 		getval(b, mid, &cmp);
@@ -274,25 +773,25 @@ blksearch(Blk *b, Key *k, Kvp *rp, int *same)
 	return ri;
 }
 
-static int
-buffill(Blk *b)
-{
-	assert(b->type == Tpivot);
-	return 2*b->nbuf + b->bufsz;
-}
-
+/*
+ * A message never packs to more than its
+ * msgsz, so callers can pass that in as an
+ * upper bound on the space needed.
+ */
 static int
 filledbuf(Blk *b, int nmsg, int needed)
 {
 	assert(b->type == Tpivot);
-	return 2*(b->nbuf+nmsg) + b->bufsz + needed > Bufspc;
+	return b->pbufsz + needed > fs->bufspc
+		|| 2*(b->nbuf+nmsg) + b->bufsz + needed > fs->nodebufspc;
 }
 
 static int
 filledleaf(Blk *b, int needed)
 {
 	assert(b->type == Tleaf);
-	return 2*(b->nval+1) + b->valsz + needed > Leafspc;
+	return b->pvalsz + needed > Pkleafspc
+		|| 2*(b->nval+1) + b->valsz + needed > Leafspc;
 }
 
 static int
@@ -304,11 +803,12 @@ filledpiv(Blk *b, int reserve)
 	 * have somewhere to go as they propagate up.
 	 */
 	assert(b->type == Tpivot);
-	return 2*(b->nval+1) + b->valsz + reserve*Kpmax > Pivspc;
+	return b->pvalsz + reserve*Kpmax > fs->pivspc
+		|| 2*(b->nval+1) + b->valsz + reserve*Kpmax > fs->nodepivspc;
 }
 
 static void
-copyup(Blk *n, Path *pp, int *nbytes)
+copyup(Blk *n, Path *pp)
 {
 	Kvp kv;
 	Msg m;
@@ -327,8 +827,6 @@ copyup(Blk *n, Path *pp, int *nbytes)
 				kv.Key = m.Key;
 		}
 		setptr(n, &kv, pp->nl->bp, blkfill(pp->nl));
-		if(nbytes != nil)
-			*nbytes += valsz(&kv);
 	}
 	if(pp->nr != nil && pp->nr->nval > 0){
 		getval(pp->nr, 0, &kv);
@@ -338,8 +836,6 @@ copyup(Blk *n, Path *pp, int *nbytes)
 				kv.Key = m.Key;
 		}
 		setptr(n, &kv, pp->nr->bp, blkfill(pp->nr));
-		if(nbytes != nil)
-			*nbytes += valsz(&kv);
 	}
 }
 
@@ -452,11 +948,11 @@ static int
 updateleaf(Tree *t, Path *up, Path *p)
 {
 	char buf[Msgmax];
-	int i, j, ok, full, spc;
+	int i, j, k, ok, full, spc;
 	Blk *b, *n;
-	Bptr bp;
 	Msg m;
 	Kvp v;
+	Ext x;
 
 	i = 0;
 	j = up->lo;
@@ -470,7 +966,7 @@ updateleaf(Tree *t, Path *up, Path *p)
 	 * messages are.
 	 */
 	full = 0;
-	spc = Leafspc - blkfill(b);
+	spc = Pkleafspc - blkfill(b);
 	if((n = newblk(b->type)) == nil)
 		return -1;
 	while(i < b->nval){
@@ -500,9 +996,10 @@ updateleaf(Tree *t, Path *up, Path *p)
 			if(m.op != Oinsert)
 				cpkvp(&v, &v, buf, sizeof(buf));
 			while(j < up->hi){
-				if(m.op == Oclearb){
-					bp = unpackbp(v.v, v.nv);
-					freebp(t, bp);
+				if(m.op == Oclearb && m.k[0] == Kdat){
+					unpackext(&x, v.v, v.nv);
+					for(k = 0; k < x.nblk; k++)
+						freebp(t, x.bp[k]);
 				}
 				ok = apply(&v, &m, buf, sizeof(buf));
 		Copy:
@@ -564,7 +1061,7 @@ updatepiv(Tree *, Path *up, Path *p, Path *pp)
 		return -1;
 	for(i = 0; i < b->nval; i++){
 		if(pp != nil && i == p->midx){
-			copyup(n, pp, nil);
+			copyup(n, pp);
 			if(pp->op == POrot || pp->op == POmerge)
 				i++;
 		}else{
@@ -576,9 +1073,7 @@ updatepiv(Tree *, Path *up, Path *p, Path *pp)
 	j = up->lo;
 	sz = 0;
 	full = 0;
-	spc = Bufspc - buffill(b);
-	if(pp != nil)
-		spc += pp->pullsz;
+	spc = fs->bufspc - pkbufsz(b, p->lo, (pp != nil) ? pp->npull : 0);
 	while(i < b->nbuf){
 		if(i == p->lo)
 			i += pp->npull;
@@ -626,7 +1121,7 @@ static int
 splitleaf(Tree *t, Path *up, Path *p, Kvp *mid)
 {
 	char buf[Msgmax];
-	int full, copied, spc, ok, halfsz;
+	int full, spc, ok, halfsz;
 	int i, j, c;
 	Blk *b, *d, *l, *r;
 	Msg m;
@@ -650,11 +1145,10 @@ splitleaf(Tree *t, Path *up, Path *p, Kvp *mid)
 	i = 0;
 	j = up->lo;
 	full = 0;
-	copied = 0;
-	halfsz = (2*b->nval + b->valsz + up->sz) / 2;
-	if(halfsz > Leafspc/2)
-		halfsz = Leafspc/2;
-	spc = Leafspc - (halfsz + Msgmax);
+	halfsz = (b->pvalsz + up->sz) / 2;
+	if(halfsz > Pkleafspc/2)
+		halfsz = Pkleafspc/2;
+	spc = Pkleafspc - (halfsz + Msgmax);
 	assert(b->nval >= 4);
 	while(i < b->nval){
 		/*
@@ -664,10 +1158,10 @@ splitleaf(Tree *t, Path *up, Path *p, Kvp *mid)
 		 * we want a valid tree.
 		 */
 		if(d == l)
-		if((i == b->nval-2) || (i >= 2 && copied >= halfsz)){
+		if((i == b->nval-2) || (i >= 2 && l->pvalsz >= halfsz)){
 			d = r;
 			full = 0;
-			spc = Leafspc - (halfsz + Msgmax);
+			spc = Pkleafspc - (halfsz + Msgmax);
 			getval(b, i, mid);
 		}
 		ok = 1;
@@ -676,7 +1170,6 @@ splitleaf(Tree *t, Path *up, Path *p, Kvp *mid)
 		switch(c){
 		case -1:
 			setval(d, &v);
-			copied += valsz(&v);
 			i++;
 			break;
 		case 1:
@@ -727,7 +1220,7 @@ splitleaf(Tree *t, Path *up, Path *p, Kvp *mid)
 static int
 splitpiv(Tree *t, Path *, Path *p, Path *pp, Kvp *mid)
 {
-	int i, copied, halfsz;
+	int i, halfsz;
 	Blk *b, *d, *l, *r;
 	Kvp tk;
 	Msg m;
@@ -746,8 +1239,7 @@ splitpiv(Tree *t, Path *, Path *p, Path *pp, Kvp *mid)
 		return -1;
 	}
 	d = l;
-	copied = 0;
-	halfsz = (2*b->nval + b->valsz)/2;
+	halfsz = b->pvalsz/2;
 	assert(b->nval >= 4);
 	for(i = 0; i < b->nval; i++){
 		/*
@@ -757,17 +1249,16 @@ splitpiv(Tree *t, Path *, Path *p, Path *pp, Kvp *mid)
 		 * we want a valid tree.
 		 */
 		if(d == l)
-		if((i == b->nval-2) || (i >= 2 && copied >= halfsz)){
+		if((i == b->nval-2) || (i >= 2 && l->pvalsz >= halfsz)){
 			d = r;
 			getval(b, i, mid);
 		}
 		if(i == p->idx){
-			copyup(d, pp, &copied);
+			copyup(d, pp);
 			continue;
 		}
 		getval(b, i, &tk);
 		setval(d, &tk);
-		copied += valsz(&tk);
 	}
 	d = l;
 	for(i = 0; i < b->nbuf; i++){
@@ -833,7 +1324,7 @@ spillscan(Blk *d, Blk *b, Msg *m, int *idx, int o)
 	int i, used;
 	Msg n;
 
-	used = 2*d->nbuf + d->bufsz;
+	used = d->pbufsz;
 	for(i = *idx; i < b->nbuf; i++){
 		getmsg(b, i, &n);
 		if(keycmp(m, &n) <= 0){
@@ -841,7 +1332,7 @@ spillscan(Blk *d, Blk *b, Msg *m, int *idx, int o)
 			return 0;
 		}
 		used += msgsz(&n);
-		if(used > Bufspc)
+		if(used > fs->bufspc)
 			return 1;
 	}
 	*idx = b->nbuf;
@@ -869,7 +1360,7 @@ spillsbuf(Blk *d, Blk *l, Blk *r, Msg *m, int *idx)
 static int
 rotate(Tree *t, Path *p, Path *pp, int midx, Blk *a, Blk *b, int halfpiv)
 {
-	int i, o, cp, sp, idx;
+	int i, o, sp, idx;
 	Blk *d, *l, *r;
 	Msg m;
 
@@ -881,26 +1372,23 @@ rotate(Tree *t, Path *p, Path *pp, int midx, Blk *a, Blk *b, int halfpiv)
 		return -1;
 	}
 	d = l;
-	cp = 0;
 	sp = -1;
 	idx = 0;
 	for(i = 0; i < a->nval; i++){
 		getval(a, i, &m);
-		if(d == l && (cp >= halfpiv || spillsbuf(d, a, b, &m, &idx))){
+		if(d == l && (l->pvalsz >= halfpiv || spillsbuf(d, a, b, &m, &idx))){
 			sp = idx;
 			d = r;
 		}
 		setval(d, &m);
-		cp += valsz(&m);
 	}
 	for(i = 0; i < b->nval; i++){
 		getval(b, i, &m);
-		if(d == l && (cp >= halfpiv || spillsbuf(d, a, b, &m, &idx))){
+		if(d == l && (l->pvalsz >= halfpiv || spillsbuf(d, a, b, &m, &idx))){
 			sp = idx;
 			d = r;
 		}
 		setval(d, &m);
-		cp += valsz(&m);
 	}
 	if(a->type == Tpivot){
 		d = l;
@@ -940,20 +1428,20 @@ rotmerge(Tree *t, Path *p, Path *pp, int idx, Blk *a, Blk *b)
 
 	assert(a->type == b->type);
 
-	na = 2*a->nval + a->valsz;
-	nb = 2*b->nval + b->valsz;
+	na = a->pvalsz;
+	nb = b->pvalsz;
 	if(a->type == Tleaf){
 		ma = 0;
 		mb = 0;
 	}else{
-		ma = 2*a->nbuf + a->bufsz;
-		mb = 2*b->nbuf + b->bufsz;
+		ma = a->pbufsz;
+		mb = b->pbufsz;
 	}
 	imbalance = na - nb;
 	if(imbalance < 0)
 		imbalance *= -1;
-	/* works for leaf, because 0 always < Bufspc */
-	if(na + nb < (Pivspc - 4*Msgmax) && ma + mb < Bufspc)
+	/* works for leaf, because 0 always < fs->bufspc */
+	if(na + nb < (fs->pivspc - 4*Msgmax) && ma + mb < fs->bufspc)
 		return merge(p, pp, idx, a, b);
 	else if(imbalance > 4*Msgmax)
 		return rotate(t, p, pp, idx, a, b, (na + nb)/2);
@@ -974,11 +1462,19 @@ trybalance(Tree *t, Path *p, Path *pp, int idx)
 	ret = -1;
 	if(p->idx == -1 || pp == nil || pp->nl == nil)
 		return 0;
-	if(pp->op != POmod || pp->op != POmerge)
+	if(pp->op != POmod)
 		return 0;
 
 	m = holdblk(pp->nl);
-	spc = (m->type == Tleaf) ? Leafspc : Pivspc;
+	spc = (m->type == Tleaf) ? Pkleafspc : fs->pivspc;
+	/*
+	 * Rebalancing rewrites a sibling, so we only
+	 * pay for it when the node is under the fill
+	 * target. Only the values count: spc leaves
+	 * out a pivot's buffer, which comes and goes.
+	 */
+	if(100*m->pvalsz >= Minfill*spc)
+		goto Done;
 	if(idx-1 >= 0){
 		getval(p->b, idx-1, &kl);
 		bp = getptr(&kl, &fill);
@@ -987,7 +1483,7 @@ trybalance(Tree *t, Path *p, Path *pp, int idx)
 				goto Out;
 			if(rotmerge(t, p, pp, idx-1, l, m) == -1)
 				goto Out;
-			goto Done;
+			goto Balanced;
 		}
 	}
 	if(idx+1 < p->b->nval){
@@ -998,9 +1494,22 @@ trybalance(Tree *t, Path *p, Path *pp, int idx)
 				goto Out;
 			if(rotmerge(t, p, pp, idx, m, r) == -1)
 				goto Out;
-			goto Done;
+			goto Balanced;
 		}
 	}
+	goto Done;
+Balanced:
+	/*
+	 * If we merged or rotated, the new copy of the
+	 * node never made it into the tree, and the
+	 * sibling gets freed along with the path once
+	 * the update is in.
+	 */
+	if(pp->op != POmod){
+		freeblk(t, m);
+		dropblk(m);
+		pp->m = holdblk((l != nil) ? l : r);
+	}
 Done:
 	ret = 0;
 Out:
@@ -1049,9 +1558,16 @@ flush(Tree *t, Path *path, int npath)
 		if(!filledpiv(p->b, 1)){
 			if(trybalance(t, p, pp, p->idx) == -1)
 				goto Error;
-			/* If we merged the root node, break out. */
-			if(up == path && pp != nil && pp->op == POmerge && p->b->nval == 2){
+			/*
+			 * If we merged the only two children of the
+			 * root, and its buffer drained into them, the
+			 * merged node becomes the root. None of the
+			 * new messages went in, so they get retried.
+			 */
+			if(up == path && pp != nil && pp->op == POmerge
+			&& p->b->nval == 2 && p->b->nbuf == pp->npull){
 				rp = pp;
+				rp->npull = 0;
 				goto Out;
 			}
 			if(updatepiv(t, up, p, pp) == -1)
@@ -1075,7 +1591,7 @@ flush(Tree *t, Path *path, int npath)
 			goto Error;
 		rp->npull = pp->npull;
 		rp->pullsz = pp->pullsz;
-		copyup(rp->nl, pp, nil);
+		copyup(rp->nl, pp);
 		enqueue(rp->nl);
 	}
 Out:
@@ -1095,6 +1611,7 @@ freepath(Tree *t, Path *path, int npath)
 		if(p->m != nil)
 			freeblk(t, p->m);
 		dropblk(p->b);
+		dropblk(p->m);
 		dropblk(p->nl);
 		dropblk(p->nr);
 	}
@@ -1184,12 +1701,14 @@ fastupsert(Tree *t, Blk *b, Msg *msg, int nmsg)
 		}
 		if(ri == -1)
 			ri = hi+1;
-		p = r->data + Pivspc + 2*(nbuf+i);
+		p = r->data + fs->nodepivspc + 2*(nbuf+i);
 		o = UNPACK16(p);
-		p = r->data + Pivspc + 2*ri;
+		p = r->data + fs->nodepivspc + 2*ri;
 		memmove(p+2, p, 2*(nbuf+i-ri));
 		PACK16(p, o);
 	}
+	/* setmsg counted the shared prefixes out of order */
+	r->pbufsz = pkbufsz(r, 0, 0);
 	enqueue(r);
 
 	lock(&t->lk);
@@ -1341,7 +1860,7 @@ btlookup(Tree *t, Key *k, Kvp *r, char *buf, int nbuf)
 	if(ok)
 		cpkvp(r, r, buf, nbuf);
 	for(i = h-2; i >= 0; i--){
-		if(p[i] == nil)
+		if(p[i] == nil || !bufmaybe(p[i], k))
 			continue;
 		j = bufsearch(p[i], k, &m, &same);
 		if(j < 0 || !same)
@@ -1374,6 +1893,44 @@ Out:
 	return err;
 }
 
+/*
+ * Finds the extent holding the data block
+ * at off: it's either keyed by off itself,
+ * or starts at the Extmax aligned offset
+ * below it.
+ */
+char*
+btlookupext(Tree *t, vlong qpath, vlong off, Ext *x)
+{
+	char *e, buf[Offksz], kvbuf[Offksz+Extsz];
+	vlong g;
+	Key k;
+	Kvp kv;
+
+	k.k = buf;
+	k.nk = Offksz;
+	k.k[0] = Kdat;
+	PACK64(k.k+1, qpath);
+	PACK64(k.k+9, off);
+	e = btlookup(t, &k, &kv, kvbuf, sizeof(kvbuf));
+	if(e == nil){
+		unpackext(x, kv.v, kv.nv);
+		x->off = off;
+		return nil;
+	}
+	g = off - off % (Extmax*fs->blksz);
+	if(e != Eexist || g == off)
+		return e;
+	PACK64(k.k+9, g);
+	if((e = btlookup(t, &k, &kv, kvbuf, sizeof(kvbuf))) != nil)
+		return e;
+	unpackext(x, kv.v, kv.nv);
+	x->off = g;
+	if(off >= g + x->nblk*fs->blksz)
+		return Eexist;
+	return nil;
+}
+
 char*
 btscan(Tree *t, Scan *s, char *pfx, int npfx)
 {
@@ -1519,3 +2076,189 @@ btdone(Scan *s)
 		dropblk(s->path[i].b);
 	free(s->path);
 }
+
+static Blk*
+retire(Compact *c, Blk *o, Blk *n)
+{
+	enqueue(n);
+	c->new[c->nnew++] = n;
+	c->old[c->nold++] = holdblk(o);
+	return holdblk(n);
+}
+
+static void
+putleaf(Compact *c, Blk *n, Kvp *k, Blk **cur)
+{
+	if(*cur == nil)
+		return;
+	enqueue(*cur);
+	setptr(n, k, (*cur)->bp, blkfill(*cur));
+	c->new[c->nnew++] = *cur;
+	*cur = nil;
+}
+
+/*
+ * Rewrites a subtree in key order, so that the
+ * new nodes get allocated next to each other,
+ * and packs runs of sparse leaves together as
+ * it goes. Returns the new node, or b itself
+ * when the budget ran out before we got to it.
+ *
+ * A pivot entered with budget left always
+ * rewrites at least one child, so it always
+ * needs rewriting itself.
+ */
+static Blk*
+compactblk(Compact *c, Blk *b)
+{
+	Blk *n, *cur, *ch, *d;
+	Kvp kv, nk, ck, v;
+	int i, j, nmerge;
+	Msg m;
+
+	if(c->budget <= 0)
+		return holdblk(b);
+	if(b->type == Tleaf){
+		if((n = dupblk(b)) == nil)
+			return nil;
+		c->budget--;
+		return retire(c, b, n);
+	}
+	if((n = newblk(Tpivot)) == nil)
+		return nil;
+	cur = nil;
+	nmerge = 0;
+	for(i = 0; i < b->nval; i++){
+		getval(b, i, &kv);
+		if(c->start != nil && i+1 < b->nval){
+			getval(b, i+1, &nk);
+			if(keycmp(&nk, c->start) <= 0){
+				putleaf(c, n, &ck, &cur);
+				setval(n, &kv);
+				continue;
+			}
+		}
+		if(c->budget <= 0){
+			if(!c->stopped){
+				cpkey(&c->next, &kv, c->nextbuf, sizeof(c->nextbuf));
+				c->stopped = 1;
+			}
+			putleaf(c, n, &ck, &cur);
+			setval(n, &kv);
+			continue;
+		}
+		if((ch = getblk(getptr(&kv, nil), 0)) == nil)
+			goto Error;
+		if(ch->type == Tleaf){
+			c->budget--;
+			if(cur != nil && b->nval - nmerge > 2
+			&& cur->pvalsz + ch->pvalsz <= Pkleafspc*Packfill/100){
+				for(j = 0; j < ch->nval; j++){
+					getval(ch, j, &v);
+					setval(cur, &v);
+				}
+				nmerge++;
+			}else{
+				putleaf(c, n, &ck, &cur);
+				if((cur = dupblk(ch)) == nil){
+					dropblk(ch);
+					goto Error;
+				}
+				ck = kv;
+			}
+			c->old[c->nold++] = ch;
+			continue;
+		}
+		putleaf(c, n, &ck, &cur);
+		d = compactblk(c, ch);
+		dropblk(ch);
+		if(d == nil)
+			goto Error;
+		setptr(n, &kv, d->bp, blkfill(d));
+		dropblk(d);
+	}
+	putleaf(c, n, &ck, &cur);
+	for(i = 0; i < b->nbuf; i++){
+		getmsg(b, i, &m);
+		setmsg(n, &m);
+	}
+	c->budget--;
+	return retire(c, b, n);
+Error:
+	if(cur != nil){
+		freeblk(c->t, cur);
+		dropblk(cur);
+	}
+	freeblk(c->t, n);
+	dropblk(n);
+	return nil;
+}
+
+/*
+ * Compacts the tree, rewriting at most about
+ * *budget nodes, starting at key k. If we run
+ * out of budget, k is set to where the next
+ * pass should pick up; otherwise it's emptied.
+ * k->k must have room for Keymax bytes.
+ */
+char*
+btcompact(Tree *t, Key *k, int *budget)
+{
+	Compact c;
+	Blk *b, *r;
+	char *err;
+	int i, h;
+
+	if(*budget <= 0)
+		return nil;
+	memset(&c, 0, sizeof(c));
+	c.t = t;
+	c.budget = *budget;
+	c.start = (k->nk > 0) ? k : nil;
+	/* pivots on the path may overshoot the budget */
+	c.old = malloc((*budget + 64)*sizeof(Blk*));
+	c.new = malloc((*budget + 64)*sizeof(Blk*));
+	if(c.old == nil || c.new == nil){
+		err = Enomem;
+		goto Out;
+	}
+	if((b = getroot(t, &h)) == nil){
+		err = Efs;
+		goto Out;
+	}
+	assert(h < 64);
+	if((r = compactblk(&c, b)) == nil){
+		dropblk(b);
+		for(i = 0; i < c.nnew; i++){
+			freeblk(t, c.new[i]);
+			dropblk(c.new[i]);
+		}
+		for(i = 0; i < c.nold; i++)
+			dropblk(c.old[i]);
+		err = Efs;
+		goto Out;
+	}
+	lock(&t->lk);
+	t->bp = r->bp;
+	t->dirty = 1;
+	unlock(&t->lk);
+	dropblk(r);
+	dropblk(b);
+	for(i = 0; i < c.nold; i++){
+		freeblk(t, c.old[i]);
+		dropblk(c.old[i]);
+	}
+	for(i = 0; i < c.nnew; i++)
+		dropblk(c.new[i]);
+	*budget = c.budget;
+	if(c.stopped){
+		memcpy(k->k, c.next.k, c.next.nk);
+		k->nk = c.next.nk;
+	}else
+		k->nk = 0;
+	err = nil;
+Out:
+	free(c.old);
+	free(c.new);
+	return err;
+}
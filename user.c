@@ -49,30 +49,41 @@ walk1(Tree *t, vlong up, char *name, Qid *qid, vlong *len)
 static char*
 slurp(Tree *t, vlong path, vlong len)
 {
-	char *e, *ret, buf[Offksz], kvbuf[Offksz + Ptrsz];
+	char *e, *ret, buf[1+8], kvbuf[1+8+Inlmax];
 	vlong o;
 	Blk *b;
-	Bptr bp;
+	Ext x;
 	Key k;
 	Kvp kv;
 
 	if((ret = malloc(len + 1)) == nil)
 		return Enomem;
-	k.k = buf;
-	k.nk = Offksz;
-	for(o = 0; o < len; o += Blksz){
-		k.k[0] = Kdat;
+	if(len > 0 && len <= Inlmax){
+		k.k = buf;
+		k.nk = sizeof(buf);
+		k.k[0] = Kinl;
 		PACK64(k.k+1, path);
-		PACK64(k.k+9, o);
-		if((e = btlookup(t, &k, &kv, kvbuf, sizeof(kvbuf))) != nil)
+		e = btlookup(t, &k, &kv, kvbuf, sizeof(kvbuf));
+		if(e == nil){
+			memset(ret, 0, len);
+			memcpy(ret, kv.v, (kv.nv < len) ? kv.nv : len);
+			ret[len] = 0;
+			return ret;
+		}
+		if(e != Eexist)
+			return e;
+	}
+	for(o = 0; o < len; o += fs->blksz){
+		if((e = btlookupext(t, path, o, &x)) != nil)
 			return e;
-		bp = unpackbp(kv.v, kv.nv);
-		if((b = getblk(bp, GBraw)) == nil)
+		if((b = getextblk(&x, (o - x.off)/fs->blksz)) == nil)
 			return Eio;
-		if(len - o >= Blksz)
-			memcpy(ret + o, b->buf, Blksz);
+		rlock(&b->datlk);
+		if(len - o >= fs->blksz)
+			memcpy(ret + o, b->data, fs->blksz);
 		else
-			memcpy(ret + o, b->buf, len - o);
+			memcpy(ret + o, b->data, len - o);
+		runlock(&b->datlk);
 	}
 	ret[len] = 0;
 	return ret;